@@ -0,0 +1,131 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "aqueue.h"
+
+#include "settings.h"
+#include "client.h"
+#include "arrival.h"
+
+#include <stdlib.h>
+#include <math.h>
+
+static struct timeout *to_arrival;
+/* arrival times (usecs) not yet taken by any client */
+static ARRAY(uint64_t) arrivals_arr;
+static struct aqueue *arrivals;
+/* idx of clients waiting for an arrival */
+static ARRAY(unsigned int) waiting_clients_arr;
+static struct aqueue *waiting_clients;
+static double next_arrival_usecs;
+
+static double arrival_get_interval_usecs(void)
+{
+	double interval = 1000000.0 / conf.arrival_rate;
+	double randu;
+
+	if (conf.arrival_constant)
+		return interval;
+
+	/* exponentially distributed inter-arrival times give a Poisson
+	   arrival process */
+	randu = (i_rand_limit(RAND_MAX) + 1.0) / ((double)RAND_MAX + 1.0);
+	return -log(randu) * interval;
+}
+
+static void arrivals_wake_clients(void)
+{
+	struct client *client;
+	unsigned int idx, count;
+
+	/* each client is woken up at most once here, since it gets queued
+	   again only after it has used up all the arrivals */
+	count = aqueue_count(waiting_clients);
+	while (count-- > 0 &&
+	       (aqueue_count(arrivals) > 0 || disconnect_clients)) {
+		idx = *array_idx(&waiting_clients_arr,
+				 aqueue_idx(waiting_clients, 0));
+		aqueue_delete_tail(waiting_clients);
+
+		if (idx >= array_count(&clients))
+			continue;
+		client = *array_idx(&clients, idx);
+		if (client == NULL || !client->arrival_waiting)
+			continue;
+
+		client->arrival_waiting = FALSE;
+		if (client_send_more_commands(client) < 0)
+			client_disconnect(client);
+	}
+}
+
+static void arrivals_timeout(void *context ATTR_UNUSED)
+{
+	uint64_t now = client_state_get_timer_usecs(), arrival_usecs;
+	unsigned int msecs;
+
+	timeout_remove(&to_arrival);
+	while (next_arrival_usecs <= now) {
+		arrival_usecs = (uint64_t)next_arrival_usecs;
+		aqueue_append(arrivals, &arrival_usecs);
+		next_arrival_usecs += arrival_get_interval_usecs();
+	}
+	arrivals_wake_clients();
+
+	msecs = (unsigned int)((next_arrival_usecs - now + 999) / 1000);
+	to_arrival = timeout_add_short(msecs, arrivals_timeout, NULL);
+}
+
+bool arrival_peek(struct client *client, uint64_t *arrival_usecs_r)
+{
+	if (aqueue_count(arrivals) == 0) {
+		if (!client->arrival_waiting) {
+			client->arrival_waiting = TRUE;
+			aqueue_append(waiting_clients, &client->idx);
+		}
+		return FALSE;
+	}
+
+	*arrival_usecs_r = *array_idx(&arrivals_arr, aqueue_idx(arrivals, 0));
+	return TRUE;
+}
+
+void arrival_take(void)
+{
+	i_assert(aqueue_count(arrivals) > 0);
+	aqueue_delete_tail(arrivals);
+}
+
+unsigned int arrivals_get_pending_count(void)
+{
+	return arrivals == NULL ? 0 : aqueue_count(arrivals);
+}
+
+void arrivals_init(void)
+{
+	if (conf.arrival_rate == 0)
+		return;
+
+	i_array_init(&arrivals_arr, 1024);
+	arrivals = aqueue_init(&arrivals_arr.arr);
+	i_array_init(&waiting_clients_arr, 128);
+	waiting_clients = aqueue_init(&waiting_clients_arr.arr);
+
+	next_arrival_usecs = client_state_get_timer_usecs() +
+		arrival_get_interval_usecs();
+	to_arrival = timeout_add_short(0, arrivals_timeout, NULL);
+}
+
+void arrivals_deinit(void)
+{
+	if (arrivals == NULL)
+		return;
+
+	timeout_remove(&to_arrival);
+	aqueue_deinit(&arrivals);
+	array_free(&arrivals_arr);
+	aqueue_deinit(&waiting_clients);
+	array_free(&waiting_clients_arr);
+}
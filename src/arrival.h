@@ -0,0 +1,24 @@
+#ifndef ARRIVAL_H
+#define ARRIVAL_H
+
+struct client;
+
+/* Open-loop scheduling: commands arrive at conf.arrival_rate per second
+   regardless of how fast the server replies. Each arrival is taken by the
+   next client that is able to send a command, and the command is timed from
+   the arrival time, so the time spent waiting for a free client is included
+   in the latency. */
+
+/* Return the oldest pending arrival's time in usecs without taking it. If
+   there are none, returns FALSE and the client's send_more_commands() is
+   called again once there are. */
+bool arrival_peek(struct client *client, uint64_t *arrival_usecs_r);
+/* Take the oldest pending arrival after a command was sent for it. */
+void arrival_take(void);
+/* Returns the number of arrivals that haven't been taken by any client. */
+unsigned int arrivals_get_pending_count(void);
+
+void arrivals_init(void);
+void arrivals_deinit(void);
+
+#endif
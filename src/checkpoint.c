@@ -8,6 +8,7 @@
 #include "mailbox.h"
 #include "imap-client.h"
 #include "checkpoint.h"
+#include "overhead.h"
 
 #include <stdlib.h>
 
@@ -269,7 +270,7 @@ static void checkpoint_send_state_cmd(struct mailbox_storage *storage,
 	}
 }
 
-void checkpoint_neg(struct mailbox_storage *storage)
+static void checkpoint_neg_real(struct mailbox_storage *storage)
 {
 	struct checkpoint_context ctx;
 	struct client *const *c;
@@ -313,7 +314,7 @@ void checkpoint_neg(struct mailbox_storage *storage)
 		if (client == NULL || client->checkpointing != storage)
 			continue;
 
-		i_assert(array_count(&client->commands) == 0);
+		i_assert(client->commands_count == 0);
 		if (client->view->select_uidnext != 0) {
 			min_uidnext = I_MIN(min_uidnext,
 					    client->view->select_uidnext);
@@ -385,10 +386,10 @@ void checkpoint_neg(struct mailbox_storage *storage)
 		if (client->checkpointing == storage)
 			client->checkpointing = NULL;
 
-		if (array_count(&client->commands) == 0 &&
+		if (client->commands_count == 0 &&
 		    client->client.state != STATE_BANNER) {
 			(void)client_send_more_commands(&client->client);
-			i_assert(array_count(&client->commands) > 0);
+			i_assert(client->commands_count > 0);
 		}
 	}
 
@@ -398,6 +399,14 @@ void checkpoint_neg(struct mailbox_storage *storage)
 	i_free_and_null(storage->checkpoint);
 }
 
+void checkpoint_neg(struct mailbox_storage *storage)
+{
+	enum overhead_type prev = overhead_begin(OVERHEAD_CHECKPOINT);
+
+	checkpoint_neg_real(storage);
+	overhead_end(prev);
+}
+
 void clients_checkpoint(struct mailbox_storage *storage)
 {
 	struct client *const *c;
@@ -417,7 +426,7 @@ void clients_checkpoint(struct mailbox_storage *storage)
 
 		if (client->storage == storage) {
 			client->checkpointing = storage;
-			if (array_count(&client->commands) > 0)
+			if (client->commands_count > 0)
 				storage->checkpoint->clients_left++;
 		}
 	}
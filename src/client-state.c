@@ -4,7 +4,6 @@
 #include "base64.h"
 #include "str.h"
 #include "strescape.h"
-#include "time-util.h"
 #include "istream.h"
 #include "ostream.h"
 #include "imap-date.h"
@@ -21,8 +20,11 @@
 #include "dsasl-client.h"
 #include "imap-client.h"
 #include "client-state.h"
+#include "latency-breakdown.h"
+#include "arrival.h"
 
 #include <stdlib.h>
+#include <time.h>
 
 struct state states[] = {
 	{ "BANNER",	  "Bann", LSTATE_NONAUTH,  0,   0,  0 },
@@ -60,6 +62,10 @@ static_assert_array_size(states, STATE_COUNT);
 unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
 unsigned int timer_counts[STATE_COUNT];
 unsigned long long timers[STATE_COUNT];
+struct latency_histogram latencies[STATE_COUNT];
+struct latency_histogram total_latencies[STATE_COUNT];
+struct latency_histogram corrected_latencies[STATE_COUNT];
+struct latency_histogram total_corrected_latencies[STATE_COUNT];
 
 bool do_rand(enum client_state state)
 {
@@ -71,19 +77,36 @@ bool do_rand_again(enum client_state state)
 	return (i_rand_limit(100)) < states[state].probability_again;
 }
 
-void client_state_add_to_timer(enum client_state state,
-			       const struct timeval *tv_start)
+uint64_t client_state_get_timer_usecs(void)
 {
-	struct timeval tv_end;
-	long long diff;
-
-	i_gettimeofday(&tv_end);
-	diff = timeval_diff_msecs(&tv_end, tv_start);
-	if (diff < 0)
-		diff = 0;
-	i_assert((unsigned long long)diff < ULLONG_MAX - timers[state]);
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) < 0)
+		i_fatal("clock_gettime(CLOCK_MONOTONIC) failed: %m");
+	return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+void client_state_add_to_timer(struct client *client, enum client_state state,
+			       uint64_t start_usecs, uint64_t intended_usecs)
+{
+	uint64_t end_usecs, diff;
+
+	end_usecs = client_state_get_timer_usecs();
+	diff = end_usecs < start_usecs ? 0 : end_usecs - start_usecs;
+	i_assert(diff < ULLONG_MAX - timers[state]);
 	timers[state] += diff;
 	timer_counts[state]++;
+
+	latency_histogram_add(&latencies[state], diff);
+	if (client != NULL) {
+		latency_breakdown_add(client->latency_breakdown_idx,
+				      state, diff);
+	}
+	if (intended_usecs > start_usecs)
+		intended_usecs = start_usecs;
+	latency_histogram_add(&corrected_latencies[state],
+			      end_usecs < intended_usecs ? 0 :
+			      end_usecs - intended_usecs);
 }
 
 static void auth_sasl_callback(struct imap_client *client, struct command *cmd,
@@ -189,13 +212,12 @@ client_get_pending_cmd_flags(struct imap_client *client,
 			     enum login_state *new_lstate_r)
 {
 	enum state_flags state_flags = 0;
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command *cmd;
+	unsigned int iter = 0;
 
 	*new_lstate_r = client->client.login_state;
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		enum state_flags flags = states[cmds[i]->state].flags;
+	while ((cmd = command_iter_next(client, &iter)) != NULL) {
+		enum state_flags flags = states[cmd->state].flags;
 
 		if ((flags & FLAG_STATECHANGE) != 0)
 			*new_lstate_r = flags2login_state(flags);
@@ -269,17 +291,16 @@ static bool client_pending_cmds_allow_statechange(struct imap_client *client,
 						  enum client_state state)
 {
 	enum login_state old_lstate, new_lstate = 0;
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command *cmd;
+	unsigned int iter = 0;
 
 	new_lstate = flags2login_state(states[state].flags);
 
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if ((states[cmds[i]->state].flags & FLAG_STATECHANGE) != 0)
+	while ((cmd = command_iter_next(client, &iter)) != NULL) {
+		if ((states[cmd->state].flags & FLAG_STATECHANGE) != 0)
 			return FALSE;
 
-		old_lstate = states[cmds[i]->state].login_state;
+		old_lstate = states[cmd->state].login_state;
 		if (new_lstate < old_lstate)
 			return FALSE;
 		if (new_lstate == old_lstate && new_lstate == LSTATE_SELECTED)
@@ -294,14 +315,22 @@ int imap_client_plan_send_more_commands(struct client *_client)
 	enum state_flags pending_flags;
 	enum login_state new_lstate;
 	enum client_state state;
+	unsigned int tag;
+	bool use_arrival;
 
-	while (array_count(&client->commands) < MAX_COMMAND_QUEUE_LEN) {
+	while (client->commands_count < conf.pipeline_depth) {
 		state = client_update_plan(client);
 		i_assert(state <= STATE_LOGOUT);
+		if (client->plan_start_usecs == 0) {
+			/* the command would be sent now, unless something
+			   below makes it wait for the earlier commands */
+			client->plan_start_usecs =
+				client_state_get_timer_usecs();
+		}
 
 		if (client->append_unfinished)
 			break;
-		if (conf.no_pipelining && array_count(&client->commands) > 0)
+		if (conf.no_pipelining && client->commands_count > 0)
 			break;
 
 		if ((states[state].flags & FLAG_STATECHANGE) != 0) {
@@ -332,12 +361,23 @@ int imap_client_plan_send_more_commands(struct client *_client)
 			/* there can be only one search running at a time */
 			continue;
 		}
+		use_arrival = conf.arrival_rate > 0 && !disconnect_clients;
+		if (use_arrival &&
+		    !arrival_peek(_client, &client->plan_start_usecs))
+			break;
 
+		tag = client->tag_counter;
 		if (imap_client_plan_send_next_cmd(client) < 0)
 			return -1;
+		/* the arrival is used only if a command was sent for it */
+		if (use_arrival && client->tag_counter != tag)
+			arrival_take();
 	}
 
-	if (!_client->delayed && do_rand(STATE_DELAY)) {
+	if (conf.arrival_rate == 0 &&
+	    !_client->delayed && do_rand(STATE_DELAY)) {
+		/* the delay is intentional, don't count it as waiting */
+		client->plan_start_usecs = 0;
 		counters[STATE_DELAY]++;
 		client_delay(&client->client, i_rand_limit(DELAY_MSECS));
 	}
@@ -520,8 +560,10 @@ seq_range_flags_ref(struct imap_client *client,
 	unsigned int i, count;
 	uint32_t seq;
 
-	if (!array_is_created(seq_range))
+	if (!array_is_created(seq_range) || conf.benchmark) {
+		/* the references are only used for verifying the replies */
 		return;
+	}
 
 	range = array_get(seq_range, &count);
 	for (i = 0; i < count; i++) {
@@ -745,7 +787,9 @@ void imap_client_handle_resp_text_code(struct imap_client *client,
 			imap_client_mailbox_close(client);
 		}
 	} else if (strcmp(key, "PERMANENTFLAGS") == 0) {
-		if (mailbox_state_set_permanent_flags(view, args + 1, client->imap4rev2_enabled) < 0)
+		if (conf.benchmark)
+			;
+		else if (mailbox_state_set_permanent_flags(view, args + 1, client->imap4rev2_enabled) < 0)
 			imap_client_input_error(client, "Broken PERMANENTFLAGS");
 	} else if (strcmp(key, "UIDNEXT") == 0) {
 		if (view->select_uidnext == 0)
@@ -824,7 +868,6 @@ static int client_handle_cmd_reply(struct imap_client *client, struct command *c
 	const char *str, *line;
 	unsigned int i;
 
-	line = imap_args_to_str(args);
 	switch (reply) {
 	case REPLY_OK:
 		if (cmd->state != STATE_DISCONNECT &&
@@ -838,6 +881,7 @@ static int client_handle_cmd_reply(struct imap_client *client, struct command *c
 		}
 		break;
 	case REPLY_NO:
+		line = imap_args_to_str(args);
 		switch (cmd->state) {
 		case STATE_COPY:
 		case STATE_MCREATE:
@@ -970,7 +1014,7 @@ static int client_handle_cmd_reply(struct imap_client *client, struct command *c
 		silent = strncmp(p, "FLAGS.SILENT", 12) == 0;
 
 		if (!silent && client->storage->assign_flag_owners &&
-		    reply == REPLY_OK) {
+		    reply == REPLY_OK && !conf.benchmark) {
 			i_assert(type != '\0');
 			i_assert(strncmp(p, "FLAGS ", 6) == 0);
 			p += 6;
@@ -1156,7 +1200,7 @@ static int start_sasl_login(struct imap_client *client)
 	return 0;
 }
 
-int imap_client_plan_send_next_cmd(struct imap_client *client)
+static int client_plan_send_next_cmd(struct imap_client *client)
 {
 	struct client *_client = &client->client;
 	enum client_state state;
@@ -1520,6 +1564,20 @@ int imap_client_plan_send_next_cmd(struct imap_client *client)
 	return 0;
 }
 
+int imap_client_plan_send_next_cmd(struct imap_client *client)
+{
+	int ret;
+
+	/* time the commands also from when they were first ready to be sent,
+	   so waiting behind slow earlier commands shows up in the corrected
+	   latencies */
+	client->cmd_intended_usecs = client->plan_start_usecs;
+	client->plan_start_usecs = 0;
+	ret = client_plan_send_next_cmd(client);
+	client->cmd_intended_usecs = 0;
+	return ret;
+}
+
 void state_callback(struct imap_client *client, struct command *cmd,
 		    const struct imap_arg *args, enum command_reply reply)
 {
@@ -1529,9 +1587,15 @@ void state_callback(struct imap_client *client, struct command *cmd,
 
 void imap_client_cmd_reply_finish(struct imap_client *client)
 {
+	if (client->checkpointing != NULL ||
+	    client->storage->checkpoint != NULL) {
+		/* waiting for the checkpoint isn't the server's fault */
+		client->plan_start_usecs = 0;
+	}
+
 	if (client->checkpointing != NULL) {
 		/* we're checkpointing */
-		if (array_count(&client->commands) > 0)
+		if (client->commands_count > 0)
 			return;
 
 		checkpoint_neg(client->storage);
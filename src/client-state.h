@@ -2,9 +2,9 @@
 #define CLIENT_STATE_H
 
 #include "seq-range-array.h"
+#include "latency-histogram.h"
 
 enum command_reply;
-struct timeval;
 struct client;
 struct imap_client;
 struct command;
@@ -82,12 +82,26 @@ typedef void command_callback_t(struct imap_client *client, struct command *cmd,
 extern struct state states[STATE_COUNT];
 extern unsigned int counters[STATE_COUNT], total_counters[STATE_COUNT];
 extern unsigned int timer_counts[STATE_COUNT];
+/* total time spent in timed commands, in microseconds */
 extern unsigned long long timers[STATE_COUNT];
+/* latencies since the last reporting interval, and the accumulated totals */
+extern struct latency_histogram latencies[STATE_COUNT];
+extern struct latency_histogram total_latencies[STATE_COUNT];
+/* same as latencies, but measured from the time the command was intended to
+   be sent, so waiting behind earlier commands isn't hidden */
+extern struct latency_histogram corrected_latencies[STATE_COUNT];
+extern struct latency_histogram total_corrected_latencies[STATE_COUNT];
 
 bool do_rand(enum client_state state);
 bool do_rand_again(enum client_state state);
-void client_state_add_to_timer(enum client_state state,
-			       const struct timeval *tv_start);
+/* Returns the current monotonic time in microseconds. The value is only
+   useful for measuring time differences. */
+uint64_t client_state_get_timer_usecs(void);
+/* Add a finished command to the timers. start_usecs is when the command was
+   actually sent and intended_usecs when it was intended to be sent. client is
+   used for the latency breakdown and may be NULL. */
+void client_state_add_to_timer(struct client *client, enum client_state state,
+			       uint64_t start_usecs, uint64_t intended_usecs);
 
 int imap_client_append(struct imap_client *client, const char *args, bool add_datetime,
 		       command_callback_t *callback, struct command **cmd_r);
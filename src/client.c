@@ -21,6 +21,7 @@
 #include "profile.h"
 #include "search.h"
 #include "test-exec.h"
+#include "latency-breakdown.h"
 #include "client.h"
 
 #include <stdlib.h>
@@ -224,6 +225,8 @@ int client_init(struct client *client, unsigned int idx,
 	}*/
 
 	ip = &conf.ips[conf.ip_idx];
+	client->latency_breakdown_idx =
+		latency_breakdown_get_idx(uc, conf.ip_idx);
 	fd = net_connect_ip(ip, client->port, NULL);
 	if (++conf.ip_idx == conf.ips_count)
 		conf.ip_idx = 0;
@@ -261,7 +264,7 @@ void client_logout(struct client *client)
 	client->state = STATE_LOGOUT;
 	client->logout_sent = TRUE;
 	if (client->user_client != NULL)
-		client->user_client->last_logout = ioloop_time;
+		client->user_client->last_logout = users_get_ioloop_msecs();
 	client->v.logout(client);
 }
 
@@ -42,11 +42,15 @@ struct client {
 	enum login_state login_state;
 	enum client_state state;
         time_t last_io;
+	/* index to latency_breakdown_get() */
+	unsigned int latency_breakdown_idx;
 
 	bool delayed:1;
 	bool disconnected:1;
 	bool logout_sent:1;
 	bool idling:1;
+	/* waiting for the next open-loop arrival */
+	bool arrival_waiting:1;
 };
 ARRAY_DEFINE_TYPE(client, struct client *);
 
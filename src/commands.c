@@ -5,11 +5,11 @@
 #include "str.h"
 #include "istream.h"
 #include "ostream.h"
-#include "time-util.h"
 #include "imap-parser.h"
 #include "mailbox.h"
 #include "imap-client.h"
 #include "commands.h"
+#include "overhead.h"
 
 #include <ctype.h>
 
@@ -134,10 +134,58 @@ struct command *command_send(struct imap_client *client, const char *cmdline,
 	return command_send_binary(client, cmdline, strlen(cmdline), callback);
 }
 
-struct command *
-command_send_binary(struct imap_client *client, const char *cmdline,
-		    unsigned int cmdline_len,
-		    command_callback_t *callback)
+static struct command **
+command_slot(struct imap_client *client, unsigned int tag)
+{
+	unsigned int idx = tag - client->commands_first_tag;
+
+	if (idx >= client->commands_slots)
+		return NULL;
+	idx = (client->commands_head + idx) % array_count(&client->commands);
+	return array_idx_modifiable(&client->commands, idx);
+}
+
+static void command_slots_grow(struct imap_client *client)
+{
+	struct command **slots;
+	unsigned int size = array_count(&client->commands);
+
+	array_idx_clear(&client->commands, size == 0 ? 15 : size*2 - 1);
+	if (client->commands_head > 0) {
+		/* the ring was full, so it wraps around unless it begins at
+		   0. move the wrapped part after the old end. */
+		slots = array_idx_modifiable(&client->commands, 0);
+		memcpy(slots + size, slots,
+		       client->commands_head * sizeof(*slots));
+		memset(slots, 0, client->commands_head * sizeof(*slots));
+	}
+}
+
+static void command_link(struct imap_client *client, struct command *cmd)
+{
+	struct command **slot;
+
+	if (client->commands_slots == 0) {
+		client->commands_head = 0;
+		client->commands_first_tag = cmd->tag;
+	}
+	/* tags are given from an increasing counter and each command is
+	   linked as it's sent */
+	i_assert(cmd->tag == client->commands_first_tag +
+		 client->commands_slots);
+	if (client->commands_slots == array_count(&client->commands))
+		command_slots_grow(client);
+
+	client->commands_slots++;
+	client->commands_count++;
+	slot = command_slot(client, cmd->tag);
+	*slot = cmd;
+}
+
+static struct command *
+command_send_binary_real(struct imap_client *client, const char *cmdline,
+			 unsigned int cmdline_len,
+			 command_callback_t *callback)
 {
 	struct command *cmd;
 	struct const_iovec iov[3];
@@ -208,32 +256,52 @@ command_send_binary(struct imap_client *client, const char *cmdline,
 	iov[2].iov_base = "\r\n";
 	iov[2].iov_len = 2;
 	o_stream_nsendv(client->client.output, iov, 3);
-	i_gettimeofday(&cmd->tv_start);
+	cmd->start_usecs = client_state_get_timer_usecs();
+	cmd->intended_usecs = client->cmd_intended_usecs != 0 ?
+		client->cmd_intended_usecs : cmd->start_usecs;
 
 	if (client->delay_timeout_ms > 0)
 		cmd->delay_to = timeout_add(client->delay_timeout_ms,
 					    command_delay_timeout, client);
 
-	array_append(&client->commands, &cmd, 1);
+	command_link(client, cmd);
 	client->last_cmd = cmd;
 	return cmd;
 }
 
+struct command *
+command_send_binary(struct imap_client *client, const char *cmdline,
+		    unsigned int cmdline_len,
+		    command_callback_t *callback)
+{
+	enum overhead_type prev = overhead_begin(OVERHEAD_COMMAND_SEND);
+	struct command *cmd;
+
+	cmd = command_send_binary_real(client, cmdline, cmdline_len, callback);
+	overhead_end(prev);
+	return cmd;
+}
+
 void command_unlink(struct imap_client *client, struct command *cmd)
 {
-	struct command *const *cmds;
-	unsigned int i, count;
-
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if (cmds[i] == cmd) {
-			array_delete(&client->commands, i, 1);
-			break;
-		}
+	struct command **slot;
+	unsigned int size = array_count(&client->commands);
+
+	slot = command_slot(client, cmd->tag);
+	i_assert(slot != NULL && *slot == cmd);
+	*slot = NULL;
+	client->commands_count--;
+
+	/* drop the replied commands from the beginning of the ring */
+	while (client->commands_slots > 0 &&
+	       *array_idx(&client->commands, client->commands_head) == NULL) {
+		client->commands_head = (client->commands_head + 1) % size;
+		client->commands_first_tag++;
+		client->commands_slots--;
 	}
-	i_assert(i < count);
 
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	client_state_add_to_timer(&client->client, cmd->state,
+				  cmd->start_usecs, cmd->intended_usecs);
 	if (client->last_cmd == cmd)
 		client->last_cmd = NULL;
 }
@@ -249,13 +317,22 @@ void command_free(struct command *cmd)
 
 struct command *command_lookup(struct imap_client *client, unsigned int tag)
 {
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command **slot;
+
+	slot = command_slot(client, tag);
+	return slot == NULL ? NULL : *slot;
+}
+
+struct command *
+command_iter_next(struct imap_client *client, unsigned int *iter)
+{
+	struct command **slot;
 
-	cmds = array_get(&client->commands, &count);
-	for (i = 0; i < count; i++) {
-		if (cmds[i]->tag == tag)
-			return cmds[i];
+	while (*iter < client->commands_slots) {
+		slot = command_slot(client,
+				    client->commands_first_tag + (*iter)++);
+		if (*slot != NULL)
+			return *slot;
 	}
 	return NULL;
 }
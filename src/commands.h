@@ -4,8 +4,6 @@
 #include "seq-range-array.h"
 #include "client-state.h"
 
-#include <sys/time.h>
-
 enum command_reply {
 	REPLY_BAD,
 	REPLY_OK,
@@ -25,7 +23,8 @@ struct command {
 	ARRAY_TYPE(seq_range) seq_range;
 
 	command_callback_t *callback;
-	struct timeval tv_start;
+	/* when the command was sent and when it was intended to be sent */
+	uint64_t start_usecs, intended_usecs;
 	struct timeout *delay_to;
 
 	bool expect_bad:1;
@@ -42,5 +41,9 @@ void command_unlink(struct imap_client *client, struct command *cmd);
 void command_free(struct command *cmd);
 
 struct command *command_lookup(struct imap_client *client, unsigned int tag);
+/* Iterate through the commands waiting for a reply, oldest first. *iter
+   must be initialized to 0. Returns NULL after the last command. */
+struct command *
+command_iter_next(struct imap_client *client, unsigned int *iter);
 
 #endif
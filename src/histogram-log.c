@@ -0,0 +1,142 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "settings.h"
+#include "workers.h"
+#include "histogram-log.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+static struct ostream *log_output = NULL;
+
+void histogram_log_init(void)
+{
+	int fd;
+
+	if (conf.histogram_log_path == NULL || workers_is_worker())
+		return;
+
+	fd = creat(conf.histogram_log_path, 0600);
+	if (fd == -1)
+		i_fatal("creat(%s) failed: %m", conf.histogram_log_path);
+	log_output = o_stream_create_fd_file_autoclose(&fd, 0);
+}
+
+void histogram_log_deinit(void)
+{
+	if (log_output != NULL)
+		o_stream_destroy(&log_output);
+}
+
+void histogram_log_write(const struct latency_histogram *hists)
+{
+	string_t *str;
+	unsigned int i;
+
+	if (log_output == NULL)
+		return;
+
+	str = t_str_new(1024);
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (hists[i].count == 0)
+			continue;
+		str_printfa(str, "%ld\t%s\t", (long)ioloop_time,
+			    states[i].name);
+		latency_histogram_export(&hists[i], str);
+		str_append_c(str, '\n');
+	}
+	if (str_len(str) == 0)
+		return;
+
+	o_stream_nsend(log_output, str_data(str), str_len(str));
+	/* flush every interval, so a crashed soak test still leaves a
+	   usable log behind */
+	if (o_stream_flush(log_output) < 0) {
+		i_error("write(%s) failed: %s", conf.histogram_log_path,
+			o_stream_get_error(log_output));
+		o_stream_destroy(&log_output);
+	}
+}
+
+static int histogram_log_find_state(const char *name)
+{
+	unsigned int i;
+
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (strcmp(states[i].name, name) == 0)
+			return i;
+	}
+	return -1;
+}
+
+static int
+histogram_log_read_line(const char *line, unsigned int from_secs,
+			unsigned int to_secs, time_t *start_time,
+			time_t *last_time, struct latency_histogram *hists)
+{
+	const char *const *args;
+	time_t stamp;
+	int state;
+
+	args = t_strsplit(line, "\t");
+	if (str_array_length(args) != 3 ||
+	    str_to_time(args[0], &stamp) < 0)
+		return -1;
+
+	if (*start_time == 0)
+		*start_time = stamp;
+	*last_time = stamp;
+	if (stamp < *start_time + (time_t)from_secs ||
+	    (to_secs != 0 && stamp >= *start_time + (time_t)to_secs))
+		return 0;
+
+	state = histogram_log_find_state(args[1]);
+	if (state < 0) {
+		/* written by a newer version */
+		return 0;
+	}
+	return latency_histogram_import(&hists[state], args[2]);
+}
+
+int histogram_log_read(const char *path, unsigned int from_secs,
+		       unsigned int to_secs,
+		       struct latency_histogram *hists)
+{
+	struct istream *input;
+	const char *line;
+	time_t start_time = 0, last_time = 0;
+	unsigned int linenum = 0;
+	int ret = 0;
+
+	input = i_stream_create_file(path, IO_BLOCK_SIZE);
+	while ((line = i_stream_read_next_line(input)) != NULL) {
+		linenum++;
+		if (line[0] == '\0' || line[0] == '#')
+			continue;
+		T_BEGIN {
+			ret = histogram_log_read_line(line, from_secs, to_secs,
+						      &start_time, &last_time,
+						      hists);
+		} T_END;
+		if (ret < 0) {
+			i_error("%s line %u: Invalid histogram", path, linenum);
+			break;
+		}
+	}
+	if (input->stream_errno != 0) {
+		i_error("read(%s) failed: %s", path,
+			i_stream_get_error(input));
+		ret = -1;
+	}
+	i_stream_unref(&input);
+	if (ret < 0)
+		return -1;
+	/* each line covers the interval ending at its timestamp */
+	return start_time == 0 ? 0 : last_time - start_time + 1;
+}
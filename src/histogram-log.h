@@ -0,0 +1,27 @@
+#ifndef HISTOGRAM_LOG_H
+#define HISTOGRAM_LOG_H
+
+#include "client-state.h"
+
+/* The histogram log has a line for each reporting interval and state with
+   latencies: "<unix time> TAB <state name> TAB <histogram>", where the
+   histogram is in the latency_histogram_export() format. Since the
+   histograms are lossless they can be merged over any time window. */
+
+/* Open conf.histogram_log_path for writing. Does nothing in the worker
+   processes, since the parent has all their latencies. */
+void histogram_log_init(void);
+void histogram_log_deinit(void);
+
+/* Write the current interval's latencies. */
+void histogram_log_write(const struct latency_histogram *hists);
+
+/* Merge the histograms in the log written between from_secs and to_secs
+   (relative to the first line, to_secs=0 means until the end) into
+   hists[STATE_COUNT]. Returns the number of seconds the log covers, or -1
+   if the log couldn't be read. */
+int histogram_log_read(const char *path, unsigned int from_secs,
+		       unsigned int to_secs,
+		       struct latency_histogram *hists);
+
+#endif
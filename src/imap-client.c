@@ -19,6 +19,7 @@
 #include "checkpoint.h"
 #include "profile.h"
 #include "test-exec.h"
+#include "overhead.h"
 #include "imap-client.h"
 
 #include <stdlib.h>
@@ -87,7 +88,7 @@ void imap_client_exists(struct imap_client *client, unsigned int msgs)
 static int imap_client_expunge(struct imap_client *client, unsigned int seq)
 {
 	struct message_metadata_dynamic *metadata;
-	unsigned int count = array_count(&client->view->uidmap);
+	unsigned int count = mailbox_view_get_msgs_count(client->view);
 
 	if (seq == 0) {
 		imap_client_input_error(client, "Tried to expunge sequence 0");
@@ -100,7 +101,7 @@ static int imap_client_expunge(struct imap_client *client, unsigned int seq)
 		return -1;
 	}
 
-	metadata = array_idx_get_space(&client->view->messages, seq - 1);
+	metadata = mailbox_view_get_metadata(client->view, seq);
 	if (metadata->fetch_refcount > 0) {
 		imap_client_input_error(client,
 			"Referenced message expunged seq=%u uid=%u",
@@ -111,53 +112,100 @@ static int imap_client_expunge(struct imap_client *client, unsigned int seq)
 	return 0;
 }
 
-static int imap_client_expunge_uid(struct imap_client *client, uint32_t uid)
+static unsigned int
+imap_client_uidmap_prev_known(const uint32_t *uidmap, unsigned int idx)
 {
+	while (idx > 0 && uidmap[idx-1] == 0)
+		idx--;
+	return idx;
+}
+
+static void
+imap_client_expunge_uids(struct imap_client *client,
+			 const ARRAY_TYPE(seq_range) *expunged_uids)
+{
+	const struct seq_range *range;
 	const uint32_t *uidmap;
-	unsigned int i, count;
+	unsigned int i, range_count, idx, known_pos;
+	uint32_t uid;
 
-	/* if there are unknown UIDs we don't really know which one of them
-	   we should expunge, but it doesn't matter because they contain no
-	   metadata at that point. */
-	uidmap = array_get(&client->view->uidmap, &count);
-	for (i = 0; i < count; i++) {
-		if (uid <= uidmap[i]) {
-			if (uid == uidmap[i]) {
+	/* Walk the UIDs and uidmap both in descending order. Expunging
+	   messages never changes the lower indexes (or moves uidmap), and the
+	   adjacent expunges get batched.
+
+	   idx is the index of the lowest known UID that is higher than the
+	   current UID (or the message count). known_pos-1 is the index of the
+	   next known UID below idx (0 = none). Everything between them is
+	   unknown. */
+	mailbox_view_expunge_flush(client->view);
+	uidmap = array_get(&client->view->uidmap, &idx);
+	known_pos = imap_client_uidmap_prev_known(uidmap, idx);
+
+	range = array_get(expunged_uids, &range_count);
+	for (i = range_count; i > 0; i--) {
+		for (uid = range[i-1].seq2;; uid--) {
+			while (known_pos > 0 && uidmap[known_pos-1] > uid) {
+				idx = known_pos - 1;
+				known_pos = imap_client_uidmap_prev_known(uidmap, idx);
+			}
+			if (known_pos > 0 && uidmap[known_pos-1] == uid) {
 				/* found it */
-				imap_client_expunge(client, i + 1);
-				return 0;
+				idx = known_pos - 1;
+				if (imap_client_expunge(client, idx + 1) < 0)
+					return;
+				/* the expunge doesn't change the lower
+				   indexes, so only a removed known UID needs
+				   the next known one to be looked up */
+				known_pos = imap_client_uidmap_prev_known(
+					uidmap, idx);
+			} else if (idx > known_pos) {
+				/* there are one or more unknown messages. we
+				   don't really know which one of them we should
+				   expunge, but it doesn't matter because they
+				   contain no metadata at that point.
+				   known_pos stays valid. */
+				idx--;
+				if (imap_client_expunge(client, idx + 1) < 0)
+					return;
+			} else {
+				imap_client_input_error(client,
+					"VANISHED UID=%u not found", uid);
+				return;
 			}
-			break;
-		}
-	}
 
-	/* there are one or more unknown messages. expunge the last one of them
-	   (none of them should have any attached metadata) */
-	if (i == 0 || uidmap[i-1] != 0) {
-		imap_client_input_error(client, "VANISHED UID=%u not found", uid);
-		return -1;
+			if (uid == range[i-1].seq1)
+				break;
+		}
 	}
-
-	imap_client_expunge(client, i);
-	return 0;
+	mailbox_view_expunge_flush(client->view);
 }
 
 static void
 imap_client_expunge_uid_range(struct imap_client *client,
 			      const ARRAY_TYPE(seq_range) *expunged_uids)
 {
+	const struct seq_range *range;
 	const uint32_t *uidmap;
-	unsigned int seq, uid_count;
-
-	uidmap = array_get(&client->view->uidmap, &uid_count);
-	for (seq = uid_count; seq > 0; seq--) {
+	unsigned int seq, range_idx;
+
+	/* all UIDs are known, so uidmap is sorted. merge it with the
+	   ranges in descending order: that keeps the lower sequences
+	   unchanged and lets adjacent expunges be batched together */
+	mailbox_view_expunge_flush(client->view);
+	uidmap = array_get(&client->view->uidmap, &seq);
+	range = array_get(expunged_uids, &range_idx);
+	while (seq > 0 && range_idx > 0) {
 		i_assert(uidmap[seq-1] != 0);
 
-		if (seq_range_exists(expunged_uids, uidmap[seq-1])) {
-			imap_client_expunge(client, seq);
-			uidmap = array_get(&client->view->uidmap, &uid_count);
+		if (uidmap[seq-1] < range[range_idx-1].seq1)
+			range_idx--;
+		else {
+			if (uidmap[seq-1] <= range[range_idx-1].seq2)
+				imap_client_expunge(client, seq);
+			seq--;
 		}
 	}
+	mailbox_view_expunge_flush(client->view);
 }
 
 static void
@@ -178,10 +226,7 @@ static int client_vanished(struct imap_client *client, const struct imap_arg *ar
 	struct mailbox_view *view = client->view;
 	const struct imap_arg *subargs;
 	ARRAY_TYPE(seq_range) uids;
-	const struct seq_range *range;
-	unsigned int i, count;
 	const char *uidset;
-	uint32_t uid;
 
 	if (!client->qresync_enabled) {
 		imap_client_input_error(client,
@@ -224,11 +269,7 @@ static int client_vanished(struct imap_client *client, const struct imap_arg *ar
 	/* we assume that there are no extra UIDs in the reply, even though
 	   it's only a SHOULD in the spec. way too difficult to handle
 	   otherwise. */
-	range = array_get(&uids, &count);
-	for (i = 0; i < count; i++) {
-		for (uid = range[i].seq1; uid <= range[i].seq2; uid++)
-			imap_client_expunge_uid(client, uid);
-	}
+	imap_client_expunge_uids(client, &uids);
 	return 0;
 }
 
@@ -387,11 +428,11 @@ int imap_client_handle_untagged(struct imap_client *client,
 		if (strcmp(str, "EXISTS") == 0)
 			imap_client_exists(client, num);
 
-                if (num > array_count(&view->uidmap) &&
+                if (num > mailbox_view_get_msgs_count(view) &&
 		    client->last_cmd->state > STATE_SELECT) {
 			imap_client_input_warn(client,
 				"seq too high (%u > %u, state=%s)",
-				num, array_count(&view->uidmap),
+				num, mailbox_view_get_msgs_count(view),
                                 states[client->last_cmd->state].name);
 		} else if (strcmp(str, "EXPUNGE") == 0) {
 			if (imap_client_expunge(client, num) < 0)
@@ -413,6 +454,10 @@ int imap_client_handle_untagged(struct imap_client *client,
 		imap_client_mailbox_close(client);
 		client->seen_bye = TRUE;
 		client->client.login_state = LSTATE_NONAUTH;
+	} else if (conf.benchmark &&
+		   (strcmp(str, "FLAGS") == 0 || strcmp(str, "SEARCH") == 0 ||
+		    strcmp(str, "THREAD") == 0)) {
+		/* these are only needed for verifying the replies */
 	} else if (strcmp(str, "FLAGS") == 0) {
 		if (mailbox_state_set_flags(view, args, client->imap4rev2_enabled) < 0)
 			imap_client_input_error(client, "Broken FLAGS");
@@ -472,6 +517,17 @@ imap_client_input_banner(struct imap_client *client,
 	return 0;
 }
 
+static bool imap_client_args_is_expunge(const struct imap_arg *args)
+{
+	const char *str;
+	unsigned int num;
+
+	return imap_arg_atom_equals(&args[0], "*") &&
+		imap_arg_get_atom(&args[1], &str) &&
+		str_to_uint(str, &num) == 0 &&
+		imap_arg_atom_equals(&args[2], "EXPUNGE");
+}
+
 static int
 imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 {
@@ -479,6 +535,11 @@ imap_client_input_args(struct imap_client *client, const struct imap_arg *args)
 	struct command *cmd;
 	enum command_reply reply;
 
+	/* a burst of EXPUNGEs is handled as a batch. everything else needs
+	   to see the view with the expunged messages removed. */
+	if (client->view != NULL && !imap_client_args_is_expunge(args))
+		mailbox_view_expunge_flush(client->view);
+
 	if (!imap_arg_get_atom(args, &tag))
 		return imap_client_input_error(client, "Broken tag");
 	args++;
@@ -558,7 +619,7 @@ static bool imap_client_skip_literal(struct imap_client *client)
 	}
 }
 
-static void imap_client_input(struct client *_client)
+static void imap_client_input_real(struct client *_client)
 {
 	struct imap_client *client = (struct imap_client *)_client;
 	const struct imap_arg *imap_args;
@@ -590,14 +651,15 @@ static void imap_client_input(struct client *_client)
 		} else {
 			if (imap_parser_get_literal_size(client->parser,
 							 &literal_size)) {
-				if (literal_size <= MAX_INLINE_LITERAL_SIZE) {
+				if (literal_size <= MAX_INLINE_LITERAL_SIZE &&
+				    !conf.benchmark) {
 					/* read the literal */
 					imap_parser_read_last_literal(
 						client->parser);
 					continue;
 				}
-				/* literal too large. we still have to skip it
-				   though. */
+				/* literal too large or not needed. we still
+				   have to skip it though. */
 				client->literal_left = literal_size;
 				continue;
 			}
@@ -627,6 +689,15 @@ static void imap_client_input(struct client *_client)
 		if (ret < 0)
 			return;
 	}
+	mailbox_view_expunge_flush(client->view);
+}
+
+static void imap_client_input(struct client *_client)
+{
+	enum overhead_type prev = overhead_begin(OVERHEAD_INPUT_PARSE);
+
+	imap_client_input_real(_client);
+	overhead_end(prev);
 }
 
 static int imap_client_output(struct client *_client)
@@ -659,20 +730,20 @@ static void imap_client_free(struct client *_client)
 	struct imap_client *client = (struct imap_client *)_client;
 	struct mailbox_storage *storage = client->storage;
 	struct mailbox_list_entry *list;
-	struct command *const *cmds;
-	unsigned int i, count;
+	struct command *cmd;
+	unsigned int iter = 0;
 	bool checkpoint;
 
 	if (conf.disconnect_quit && _client->login_state != LSTATE_NONAUTH)
 		lib_exit(1);
-	cmds = array_get(&client->commands, &count);
-	checkpoint = client->checkpointing != NULL && count > 0;
+	checkpoint = client->checkpointing != NULL &&
+		client->commands_count > 0;
 
 	imap_client_mailbox_close(client);
 	mailbox_view_free(&client->view);
 
-	for (i = 0; i < count; i++)
-		command_free(cmds[i]);
+	while ((cmd = command_iter_next(client, &iter)) != NULL)
+		command_free(cmd);
 	array_free(&client->commands);
 
 	if (client->qresync_select_cache != NULL)
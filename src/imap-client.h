@@ -62,9 +62,22 @@ struct imap_client {
 	struct mailbox_storage *storage;
 	struct mailbox_view *view;
 	struct mailbox_storage *checkpointing;
+	/* Commands waiting for a tagged reply. This is a ring of
+	   commands_slots slots starting from commands_head, indexed by
+	   tag - commands_first_tag. A replied command leaves a NULL slot until
+	   all the older commands have been replied to. */
 	ARRAY(struct command *) commands;
+	unsigned int commands_head, commands_slots, commands_first_tag;
+	/* number of non-NULL slots */
+	unsigned int commands_count;
 	struct command *last_cmd;
 	unsigned int tag_counter;
+	/* When plan[0] was first ready to be sent, or its open-loop arrival
+	   time. 0 if not known yet. */
+	uint64_t plan_start_usecs;
+	/* Intended start time for the commands sent for the current plan
+	   step, 0 when not sending planned commands. */
+	uint64_t cmd_intended_usecs;
 
 	/* Highest MODSEQ seen in untagged FETCH replies. Tagged reply
 	   handler updates highest_modseq based on this and resets to 0. */
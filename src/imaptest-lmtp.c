@@ -4,7 +4,6 @@
 #include "llist.h"
 #include "ioloop.h"
 #include "istream.h"
-#include "time-util.h"
 #include "smtp-address.h"
 #include "smtp-client.h"
 #include "smtp-client-connection.h"
@@ -15,8 +14,6 @@
 #include "client-state.h"
 #include "imaptest-lmtp.h"
 
-#include <sys/time.h>
-
 #define LMTP_DELIVERY_TIMEOUT_MSECS (1000*60)
 
 struct imaptest_lmtp_delivery {
@@ -25,7 +22,7 @@ struct imaptest_lmtp_delivery {
 	struct smtp_client_connection *lmtp_conn;
 	struct smtp_client_transaction *lmtp_trans;
 
-	struct timeval tv_start;
+	uint64_t start_usecs;
 	struct smtp_address *rcpt_to;
 	struct istream *data_input;
 	struct timeout *to;
@@ -33,7 +30,7 @@ struct imaptest_lmtp_delivery {
 
 static struct smtp_client *lmtp_client = NULL;
 static struct imaptest_lmtp_delivery *lmtp_deliveries = NULL;
-static unsigned int lmtp_count = 0;
+static unsigned int lmtp_count = 0, lmtp_failures = 0;
 static time_t lmtp_last_warn;
 
 bool imaptest_lmtp_have_deliveries(void)
@@ -41,6 +38,13 @@ bool imaptest_lmtp_have_deliveries(void)
 	return lmtp_deliveries != NULL;
 }
 
+void imaptest_lmtp_get_stats(unsigned int *active_r,
+			     unsigned int *failures_r)
+{
+	*active_r = lmtp_count;
+	*failures_r = lmtp_failures;
+}
+
 static void imaptest_lmtp_free(struct imaptest_lmtp_delivery *d)
 {
 	DLLIST_REMOVE(&lmtp_deliveries, d);
@@ -69,6 +73,7 @@ imaptest_lmtp_rcpt_to_callback(const struct smtp_reply *reply,
 			       struct imaptest_lmtp_delivery *d)
 {
 	if (!smtp_reply_is_success(reply)) {
+		lmtp_failures++;
 		i_error("LMTP: RCPT TO <%s> failed: %s",
 			smtp_address_encode(d->rcpt_to),
 			smtp_reply_log(reply));
@@ -80,12 +85,14 @@ imaptest_lmtp_data_callback(const struct smtp_reply *reply,
 			       struct imaptest_lmtp_delivery *d)
 {
 	if (!smtp_reply_is_success(reply)) {
+		lmtp_failures++;
 		i_error("LMTP: DATA for <%s> failed: %s",
 			smtp_address_encode(d->rcpt_to),
 			smtp_reply_log(reply));
 	} else {
 		counters[STATE_LMTP]++;
-		client_state_add_to_timer(STATE_LMTP, &d->tv_start);
+		client_state_add_to_timer(NULL, STATE_LMTP, d->start_usecs,
+					  d->start_usecs);
 	}
 }
 
@@ -98,6 +105,7 @@ imaptest_lmtp_data_dummy_callback(const struct smtp_reply *reply ATTR_UNUSED,
 
 static void imaptest_lmtp_timeout(struct imaptest_lmtp_delivery *d)
 {
+	lmtp_failures++;
 	i_error("LMTP: Timeout in %s",
 		smtp_client_transaction_get_state_name(d->lmtp_trans));
 	smtp_client_connection_disconnect(d->lmtp_conn);
@@ -136,7 +144,7 @@ void imaptest_lmtp_send(unsigned int port, unsigned int lmtp_max_parallel_count,
 	d->to = timeout_add(LMTP_DELIVERY_TIMEOUT_MSECS,
 			    imaptest_lmtp_timeout, d);
 	d->rcpt_to = smtp_address_clone(default_pool, rcpt_to);
-	i_gettimeofday(&d->tv_start);
+	d->start_usecs = client_state_get_timer_usecs();
 
 
 	ip = &conf.ips[conf.ip_idx];
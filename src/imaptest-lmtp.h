@@ -6,5 +6,8 @@ bool imaptest_lmtp_have_deliveries(void);
 void imaptest_lmtp_send(unsigned int port, unsigned int lmtp_max_parallel_count,
 			const struct smtp_address *rcpt_to, struct mailbox_source *source);
 void imaptest_lmtp_delivery_deinit(void);
+/* Returns the number of deliveries in progress and failed so far. */
+void imaptest_lmtp_get_stats(unsigned int *active_r,
+			     unsigned int *failures_r);
 
 #endif
@@ -20,16 +20,26 @@
 #include "mailbox-source.h"
 #include "imap-client.h"
 #include "user.h"
+#include "userfile.h"
 #include "profile.h"
 #include "checkpoint.h"
 #include "commands.h"
 #include "test-exec.h"
 #include "imaptest-lmtp.h"
+#include "arrival.h"
+#include "pipeline-sweep.h"
+#include "latency-breakdown.h"
+#include "stats-export.h"
+#include "histogram-log.h"
+#include "selftest-server.h"
+#include "overhead.h"
+#include "workers.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
 
 struct settings conf;
 bool profile_running = FALSE;
@@ -39,43 +49,184 @@ static int return_value = 0;
 static time_t next_checkpoint_time;
 static struct ostream *results_output = NULL;
 static struct timeout *to_stop;
-static unsigned int final_wait_secs;
+static unsigned int final_wait_secs = 30;
 
 #define STATE_IS_VISIBLE(state) \
 	(states[i].probability != 0)
 
+static const struct {
+	const char *name;
+	double percentile;
+} latency_percentiles[] = {
+	{ "p50", 50 },
+	{ "p90", 90 },
+	{ "p99", 99 },
+	{ "p99.9", 99.9 },
+};
+
 static void print_results_header(void)
 {
 	string_t *str = t_str_new(128);
-	unsigned int i;
+	const char *name;
+	unsigned int i, j;
 
 	for (i = 1; i < STATE_COUNT; i++) {
 		if (!STATE_IS_VISIBLE(i))
 			continue;
-		str_printfa(str, "\t%s count\t%s msecs",
-			    states[i].name, states[i].name);
+		str_printfa(str, "\t%s count\t%s timed\t%s usecs",
+			    states[i].name, states[i].name, states[i].name);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%s %s usecs", states[i].name,
+				    latency_percentiles[j].name);
+		}
+		str_printfa(str, "\t%s max usecs", states[i].name);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%s corrected %s usecs",
+				    states[i].name, latency_percentiles[j].name);
+		}
+		str_printfa(str, "\t%s corrected max usecs", states[i].name);
 	}
+	for (i = 0; i < latency_breakdown_count(); i++) {
+		name = latency_breakdown_get(i)->name;
+		str_printfa(str, "\t%s count", name);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			str_printfa(str, "\t%s %s usecs", name,
+				    latency_percentiles[j].name);
+		}
+		str_printfa(str, "\t%s max usecs", name);
+	}
+	for (i = 0; i < OVERHEAD_COUNT; i++)
+		str_printfa(str, "\timaptest %s usecs", overhead_names[i]);
+	str_append(str, "\timaptest wait usecs\timaptest cpu %");
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
 }
 
-static void print_results(void)
+static void
+print_results_latencies(string_t *str, const struct latency_histogram *hist)
+{
+	unsigned int i;
+
+	for (i = 0; i < N_ELEMENTS(latency_percentiles); i++) {
+		str_printfa(str, "\t%llu", (unsigned long long)
+			    latency_histogram_get_percentile(hist,
+				latency_percentiles[i].percentile));
+	}
+	str_printfa(str, "\t%llu", (unsigned long long)hist->max);
+}
+
+static void print_results(const struct overhead_stats *overhead)
 {
 	string_t *str = t_str_new(128);
+	struct latency_histogram *hist;
 	unsigned int i;
 
 	for (i = 1; i < STATE_COUNT; i++) {
 		if (!STATE_IS_VISIBLE(i))
 			continue;
 
-		str_printfa(str, "\t%d\t%d\t%lld", counters[i], timer_counts[i], timers[i]);
+		str_printfa(str, "\t%u\t%u\t%llu", counters[i], timer_counts[i], timers[i]);
 		timers[i] = 0;
 		timer_counts[i] = 0;
+
+		print_results_latencies(str, &latencies[i]);
+		print_results_latencies(str, &corrected_latencies[i]);
+	}
+	for (i = 0; i < latency_breakdown_count(); i++) {
+		/* all the states combined */
+		hist = t_new(struct latency_histogram, 1);
+		latency_breakdown_get_interval(i, hist);
+		str_printfa(str, "\t%llu", (unsigned long long)hist->count);
+		print_results_latencies(str, hist);
+	}
+	for (i = 0; i < OVERHEAD_COUNT; i++) {
+		str_printfa(str, "\t%llu",
+			    (unsigned long long)overhead->usecs[i]);
 	}
+	str_printfa(str, "\t%llu\t%u", (unsigned long long)overhead->wait_usecs,
+		    overhead->cpu_percent);
 	str_append_c(str, '\n');
 	o_stream_nsend(results_output, str_data(str)+1, str_len(str)-1);
 }
 
+static void latencies_update_totals(void)
+{
+	unsigned int i;
+
+	histogram_log_write(latencies);
+	for (i = 0; i < STATE_COUNT; i++) {
+		latency_histogram_merge(&total_latencies[i], &latencies[i]);
+		latency_histogram_reset(&latencies[i]);
+		latency_histogram_merge(&total_corrected_latencies[i],
+					&corrected_latencies[i]);
+		latency_histogram_reset(&corrected_latencies[i]);
+	}
+	latency_breakdown_update_totals();
+}
+
+static void print_latencies_table(const char *title,
+				  const struct latency_histogram *hists)
+{
+	const struct latency_histogram *hist;
+	unsigned int i, j;
+
+	printf("\n%s (msecs):\n%-12s %8s", title, "", "count");
+	for (j = 0; j < N_ELEMENTS(latency_percentiles); j++)
+		printf(" %9s", latency_percentiles[j].name);
+	printf(" %9s\n", "max");
+
+	for (i = 1; i < STATE_COUNT; i++) {
+		hist = &hists[i];
+		if (hist->count == 0)
+			continue;
+
+		printf("%-12s %8llu", states[i].name,
+		       (unsigned long long)hist->count);
+		for (j = 0; j < N_ELEMENTS(latency_percentiles); j++) {
+			printf(" %9.3f", latency_histogram_get_percentile(hist,
+				latency_percentiles[j].percentile) / 1000.0);
+		}
+		printf(" %9.3f\n", hist->max / 1000.0);
+	}
+}
+
+static void print_latencies(void)
+{
+	const struct latency_breakdown *breakdown;
+	unsigned int i;
+
+	print_latencies_table("Latency", total_latencies);
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (total_corrected_latencies[i].sum != total_latencies[i].sum)
+			break;
+	}
+	if (i < STATE_COUNT) {
+		/* some commands had to wait before they could be sent */
+		print_latencies_table("Latency from intended start",
+				      total_corrected_latencies);
+	}
+
+	for (i = 0; i < latency_breakdown_count(); i++) {
+		breakdown = latency_breakdown_get(i);
+		if (breakdown->total_latencies == NULL)
+			continue;
+		print_latencies_table(t_strdup_printf("Latency for %s",
+						      breakdown->name),
+				      breakdown->total_latencies);
+	}
+}
+
+static void print_avg_msecs(double msecs)
+{
+	/* keep sub-millisecond averages visible within the 4 char column */
+	if (msecs < 9.995)
+		printf("%4.2f ", msecs);
+	else if (msecs < 99.95)
+		printf("%4.1f ", msecs);
+	else
+		printf("%4u ", (unsigned int)msecs);
+}
+
 static void print_timers(void)
 {
 	unsigned int i;
@@ -87,8 +238,8 @@ static void print_timers(void)
 		if (!STATE_IS_VISIBLE(i))
 			continue;
 
-		printf("%4d ", timer_counts[i] == 0 ? 0 :
-		       (unsigned int)(timers[i] / timer_counts[i]));
+		print_avg_msecs(timer_counts[i] == 0 ? 0 :
+				timers[i] / (double)timer_counts[i] / 1000);
 		timers[i] = 0;
 		timer_counts[i] = 0;
 	}
@@ -135,85 +286,62 @@ static void print_header(void)
 
 static void print_stalled_imap_client(string_t *str, struct imap_client *client)
 {
-	struct command *const *cmds;
-	unsigned int cmdcount;
+	struct command *cmd;
+	unsigned int iter = 0;
 
-	cmds = array_get(&client->commands, &cmdcount);
+	cmd = command_iter_next(client, &iter);
 	if (client->seen_bye)
 		str_append(str, "BYE, waiting for disconnect");
-	else if (cmdcount == 0)
+	else if (cmd == NULL)
 		str_append(str, states[client->client.state].name);
 	else {
-		str_printfa(str, "command: %u %s",
-			    cmds[0]->tag, cmds[0]->cmdline);
+		str_printfa(str, "command: %u %s", cmd->tag, cmd->cmdline);
 	}
 }
 
-static void print_timeout(void *context ATTR_UNUSED)
+static void clients_get_stats(struct client_stats *stats_r,
+			      ARRAY_TYPE(const_string) *stalled_lines)
 {
 #define CLIENT_STALLED_SECS(c) \
-	(((c)->to != NULL || (c)->idling) ? 0 : \
+	(((c)->to != NULL || (c)->idling || (c)->arrival_waiting) ? 0 : \
 	 (ioloop_time - (c)->last_io))
 	struct client *const *c;
 	string_t *str;
-        static int rowcount = 0;
-	unsigned int i, count, banner_waits, stall_count;
-
-	if (results_output != NULL)
-		print_results();
-	if ((rowcount++ % 10) == 0) {
-		if (rowcount > 1 && results_output == NULL) print_timers();
-		print_header();
-	}
-
-        for (i = 1; i < STATE_COUNT; i++) {
-		if (!STATE_IS_VISIBLE(i))
-			continue;
-		printf("%4d ", counters[i]);
-		total_counters[i] += counters[i];
-		counters[i] = 0;
-        }
+	const char *line;
+	unsigned int i, count;
 
+	i_zero(stats_r);
+	stats_r->clients_count = clients_count;
+	stats_r->created_count = array_count(&clients);
+	stats_r->target_count = conf.clients_count;
+	stats_r->arrivals_pending = arrivals_get_pending_count();
+	stats_r->disconnects = total_disconnects;
+	imaptest_lmtp_get_stats(&stats_r->lmtp_active, &stats_r->lmtp_failures);
 	stalled = FALSE;
-	banner_waits = 0;
-	stall_count = 0;
 
-#define SHORT_STALL_PRINT_SECS 3
 	c = array_get(&clients, &count);
 	for (i = 0; i < count; i++) {
 		if (c[i] == NULL)
 			continue;
 		if (c[i]->state == STATE_BANNER)
-			banner_waits++;
+			stats_r->banner_waits++;
 
 		unsigned int stalled_secs = CLIENT_STALLED_SECS(c[i]);
-		if (stalled_secs > SHORT_STALL_PRINT_SECS)
-			stall_count++;
+		if (stalled_secs > STALL_PRINT_SHORT_SECS)
+			stats_r->stall_count++;
 		if (stalled_secs >= conf.stalled_disconnect_timeout &&
 		    conf.stalled_disconnect_timeout > 0)
 			client_disconnect(c[i]);
         }
 
-	printf("%3d/%3d", (clients_count - banner_waits), clients_count);
-	if (stall_count > 0)
-		printf(" (%u stalled >%us)", stall_count, SHORT_STALL_PRINT_SECS);
-
-	if (array_count(&clients) < conf.clients_count) {
-		printf(" [%d%%]", array_count(&clients) * 100 /
-		       conf.clients_count);
-	}
-
-#define LONG_STALL_PRINT_SECS 15
-	printf("\n");
-	str = t_str_new(256);
 	for (i = 0; i < count; i++) {
 		unsigned int stalled_secs =
 			c[i] == NULL ? 0 : CLIENT_STALLED_SECS(c[i]);
-		if (stalled_secs > LONG_STALL_PRINT_SECS &&
+		if (stalled_secs > STALL_PRINT_LONG_SECS &&
 		    c[i]->state != STATE_BANNER) {
 			struct imap_client *client = imap_client(c[i]);
 
-			str_truncate(str, 0);
+			str = t_str_new(256);
 			str_printfa(str, " - %d stalled for %u secs in ",
 				    c[i]->global_id,
 				    (unsigned)(ioloop_time - c[i]->last_io));
@@ -221,10 +349,14 @@ static void print_timeout(void *context ATTR_UNUSED)
 				print_stalled_imap_client(str, client);
 
 			stalled = TRUE;
-                        printf("%s\n", str_c(str));
+			line = str_c(str);
+			array_append(stalled_lines, &line, 1);
                 }
 	}
+}
 
+static void clients_checkpoint_timeout(void)
+{
 	if (ioloop_time >= next_checkpoint_time &&
 	    conf.checkpoint_interval > 0) {
 		struct hash_iterate_context *iter;
@@ -239,6 +371,88 @@ static void print_timeout(void *context ATTR_UNUSED)
 	}
 }
 
+static void print_timeout(void *context ATTR_UNUSED)
+{
+	struct client_stats stats;
+	struct overhead_stats overhead;
+	ARRAY_TYPE(const_string) stalled_lines;
+	const char *const *line;
+        static int rowcount = 0;
+	static bool overhead_warned = FALSE;
+	unsigned int i;
+
+	t_array_init(&stalled_lines, 8);
+	if (workers_is_parent())
+		workers_get_client_stats(&stats, &stalled_lines);
+	else {
+		clients_get_stats(&stats, &stalled_lines);
+		clients_checkpoint_timeout();
+	}
+	if (workers_is_worker()) {
+		/* the parent process prints the statistics */
+		worker_send_stats(&stats, &stalled_lines);
+		return;
+	}
+
+	overhead_get_interval(&overhead);
+	stats_export_interval(&stats, &overhead);
+	if (results_output != NULL)
+		print_results(&overhead);
+	pipeline_sweep_add_latencies(latencies);
+	latencies_update_totals();
+	if ((rowcount++ % 10) == 0) {
+		if (rowcount > 1 && results_output == NULL) print_timers();
+		print_header();
+	}
+
+        for (i = 1; i < STATE_COUNT; i++) {
+		if (!STATE_IS_VISIBLE(i))
+			continue;
+		printf("%4d ", counters[i]);
+		total_counters[i] += counters[i];
+		counters[i] = 0;
+        }
+
+	printf("%3d/%3d", (stats.clients_count - stats.banner_waits),
+	       stats.clients_count);
+	if (stats.stall_count > 0) {
+		printf(" (%u stalled >%us)", stats.stall_count,
+		       STALL_PRINT_SHORT_SECS);
+	}
+
+	if (stats.arrivals_pending > 0)
+		printf(" (%u queued)", stats.arrivals_pending);
+
+	if (stats.created_count < stats.target_count) {
+		printf(" [%d%%]", stats.created_count * 100 /
+		       stats.target_count);
+	}
+	printf("\n");
+
+	array_foreach(&stalled_lines, line)
+		printf("%s\n", *line);
+
+	if (conf.overhead_warn_percent == 0 ||
+	    overhead.cpu_percent < conf.overhead_warn_percent)
+		overhead_warned = FALSE;
+	else if (!overhead_warned) {
+		/* warn only when crossing the threshold */
+		printf("Warning: imaptest is using %u%% CPU (parse %llu ms, "
+		       "verify %llu ms, send %llu ms, checkpoint %llu ms) - "
+		       "the results may be limited by imaptest, not the "
+		       "server\n", overhead.cpu_percent,
+		       (unsigned long long)
+		       overhead.usecs[OVERHEAD_INPUT_PARSE] / 1000,
+		       (unsigned long long)
+		       overhead.usecs[OVERHEAD_FETCH_VERIFY] / 1000,
+		       (unsigned long long)
+		       overhead.usecs[OVERHEAD_COMMAND_SEND] / 1000,
+		       (unsigned long long)
+		       overhead.usecs[OVERHEAD_CHECKPOINT] / 1000);
+		overhead_warned = TRUE;
+	}
+}
+
 static void print_total(void)
 {
 	unsigned int i;
@@ -255,6 +469,10 @@ static void print_total(void)
 		printf("%4d ", total_counters[i]);
 	}
 	printf("\n");
+
+	latencies_update_totals();
+	print_latencies();
+	pipeline_sweep_print();
 }
 
 static void fix_probabilities(void)
@@ -291,7 +509,8 @@ static void fix_probabilities(void)
 
 bool imaptest_has_clients(void)
 {
-	return clients_count > 0 || imaptest_lmtp_have_deliveries();
+	return clients_count > 0 || imaptest_lmtp_have_deliveries() ||
+		workers_have_running();
 }
 
 static void sig_die(const siginfo_t *si ATTR_UNUSED, void *context ATTR_UNUSED)
@@ -329,6 +548,12 @@ static void timeout_stop(void *context)
 	}
 }
 
+static void pipeline_sweep_finished(void)
+{
+	/* stop the same way as with secs */
+	timeout_stop(NULL);
+}
+
 static struct state *state_find(const char *name)
 {
 	unsigned int i;
@@ -355,18 +580,27 @@ static void clients_unref(void)
 
 static struct mailbox_source *imaptest_mailbox_source(void)
 {
+	struct mailbox_source *source;
 	struct state *state;
+	struct stat st;
 
 	state = state_find("APPEND");
 	if (state->probability == 0) {
 		/* we're not going to append anything, don't give an error
-		   if mbox_path doesn't exist. */
+		   if mbox_path doesn't exist. msg_sizes has no effect
+		   either. */
 		return mailbox_source_new_random(0);
 	}
 	if (conf.random_msg_size > 0)
-		return mailbox_source_new_random(conf.random_msg_size);
+		source = mailbox_source_new_random(conf.random_msg_size);
+	else if (stat(conf.mbox_path, &st) == 0 && S_ISDIR(st.st_mode))
+		source = mailbox_source_new_dir(conf.mbox_path);
 	else
-		return mailbox_source_new_mbox(conf.mbox_path);
+		source = mailbox_source_new_mbox(conf.mbox_path);
+	if (array_is_created(&conf.msg_sizes) &&
+	    !mailbox_source_enable_size_sampling(source))
+		i_fatal("msg_sizes requires an mbox or a directory of messages");
+	return source;
 }
 
 static void imaptest_run(void)
@@ -377,6 +611,8 @@ static void imaptest_run(void)
 	next_checkpoint_time = ioloop_time + conf.checkpoint_interval;
 	to = timeout_add(1000, print_timeout, NULL);
 	if (!profile_running) {
+		arrivals_init();
+		pipeline_sweep_init(pipeline_sweep_finished);
 		for (i = 0; i < INIT_CLIENT_COUNT && i < conf.clients_count; i++)
 			client_new_random(i, mailbox_source);
 	}
@@ -384,8 +620,32 @@ static void imaptest_run(void)
         io_loop_run(ioloop);
 
 	timeout_remove(&to);
+	arrivals_deinit();
+	pipeline_sweep_deinit();
 	clients_unref();
 
+	if (workers_is_worker()) {
+		struct client_stats stats;
+		ARRAY_TYPE(const_string) stalled_lines;
+
+		/* send the statistics since the last timeout */
+		i_zero(&stats);
+		t_array_init(&stalled_lines, 1);
+		worker_send_stats(&stats, &stalled_lines);
+	} else {
+		print_total();
+	}
+}
+
+static void imaptest_run_workers(void)
+{
+	struct timeout *to;
+
+	to = timeout_add(1000, print_timeout, NULL);
+	/* stops after all the workers have exited */
+	io_loop_run(ioloop);
+	timeout_remove(&to);
+
 	print_total();
 }
 
@@ -409,28 +669,103 @@ static void imaptest_run_tests(const char *path)
 	test_parser_deinit(&test_parser);
 }
 
-static void conf_read_usernames(const char *path)
+static void
+imaptest_run_clients(struct profile *profile, const char *testpath)
 {
-	struct istream *input;
-	int fd;
-	const char *line;
+	mailbox_source = imaptest_mailbox_source();
+	users_init(profile, mailbox_source);
+	mailboxes_init();
+	clients_init();
 
-	i_array_init(&conf.usernames, 32);
-	fd = open(path, O_RDONLY);
-	if (fd == -1)
-		i_fatal("open(%s) failed: %m", path);
-	input = i_stream_create_fd_autoclose(&fd, (size_t)-1);
-	i_stream_set_return_partial_line(input, TRUE);
-	while ((line = i_stream_read_next_line(input)) != NULL) {
-		if (*line != '\0' && *line != ':') {
-			line = i_strdup(line);
-			array_append(&conf.usernames, &line, 1);
-		}
+	i_array_init(&clients, CLIENTS_COUNT);
+	if (testpath == NULL)
+		imaptest_run();
+	else
+		imaptest_run_tests(testpath);
+
+	imaptest_lmtp_delivery_deinit();
+	clients_deinit();
+	mailboxes_deinit();
+	users_deinit();
+	if (profile != NULL)
+		profile_deinit();
+	mailbox_source_unref(&mailbox_source);
+}
+
+static void conf_parse_latency_breakdown(const char *value)
+{
+	const char *const *args;
+
+	for (args = t_strsplit(value, ","); *args != NULL; args++) {
+		if (strcmp(*args, "profile") == 0)
+			conf.latency_breakdown_profile = TRUE;
+		else if (strcmp(*args, "ip") == 0)
+			conf.latency_breakdown_ip = TRUE;
+		else
+			i_fatal("Invalid latency_breakdown: %s", *args);
 	}
-	i_stream_destroy(&input);
+}
 
-	if (array_count(&conf.usernames) == 0)
-		i_fatal("No usernames in file %s", path);
+static void conf_parse_pipeline_sweep(const char *value)
+{
+	const char *const *args;
+	unsigned int depth;
+
+	if (!array_is_created(&conf.pipeline_sweep_depths))
+		i_array_init(&conf.pipeline_sweep_depths, 8);
+	for (args = t_strsplit(value, ","); *args != NULL; args++) {
+		if (str_to_uint(*args, &depth) < 0 || depth == 0)
+			i_fatal("Invalid pipeline_sweep depth: %s", *args);
+		array_append(&conf.pipeline_sweep_depths, &depth, 1);
+	}
+}
+
+static int
+msg_size_weight_cmp(const struct msg_size_weight *s1,
+		    const struct msg_size_weight *s2)
+{
+	if (s1->max_size < s2->max_size)
+		return -1;
+	return s1->max_size > s2->max_size ? 1 : 0;
+}
+
+static void conf_parse_msg_sizes(const char *value)
+{
+	struct msg_size_weight size;
+	const char *const *args, *p, *suffix;
+	unsigned int total_weight = 0;
+
+	if (!array_is_created(&conf.msg_sizes))
+		i_array_init(&conf.msg_sizes, 8);
+	for (args = t_strsplit(value, ","); *args != NULL; args++) {
+		p = strchr(*args, ':');
+		if (p == NULL ||
+		    str_parse_uoff(t_strdup_until(*args, p), &size.max_size,
+				   &suffix) < 0 ||
+		    str_to_uint(p + 1, &size.weight) < 0)
+			i_fatal("Invalid msg_sizes: %s", *args);
+
+		switch (i_toupper(*suffix)) {
+		case 'G':
+			size.max_size *= 1024;
+			/* fall through */
+		case 'M':
+			size.max_size *= 1024;
+			/* fall through */
+		case 'K':
+			size.max_size *= 1024;
+			suffix++;
+			break;
+		}
+		/* suffix points to the copy made by t_strdup_until() */
+		if (*suffix != '\0')
+			i_fatal("Invalid msg_sizes size: %s", *args);
+		array_append(&conf.msg_sizes, &size, 1);
+		total_weight += size.weight;
+	}
+	if (total_weight == 0)
+		i_fatal("msg_sizes: All weights are 0");
+	array_sort(&conf.msg_sizes, msg_size_weight_cmp);
 }
 
 static void print_help(void)
@@ -440,23 +775,34 @@ static void print_help(void)
 "         [master=USER] [pass=PASSWORD] [mech=MECH] [seed=SEED]\n"
 "         [host=HOST] [port=PORT] [mbox=MBOX] [clients=CC] [msgs=NMSG]\n"
 "         [box=MAILBOX] [copybox=DESTBOX] [-] [<state>[=<n%%>[,<m%%>]]]\n"
-"         [random] [no_pipelining] [no_tracking] [checkpoint=<secs>]\n"
-"         [imap4rev2]\n"
+"         [random] [no_pipelining] [no_tracking] [benchmark]\n"
+"         [checkpoint=<secs>] [imap4rev2] [workers=N] [rate=RATE]\n"
+"         [arrival=poisson|constant]\n"
+"         [pipeline=DEPTH] [pipeline_sweep=DEPTH,...] [pipeline_sweep_secs=N]\n"
+"         [msg_cache=MB] [msg_sizes=SIZE:WEIGHT,...] [random_msg_size=BYTES]\n"
+"         [random_msg_type=garbage|rfc822] [random_msg_dist=uniform|exponential]\n"
+"         [latency_breakdown=profile,ip] [stats_json=FILE] [stats_http=PORT]\n"
+"         [histogram_log=FILE] [selftest_server] [overhead_warn=PERCENT]\n"
+"imaptest report=FILE [report_window=FROM-TO]\n"
 "\n"
 " USER = username (and domain) template, e.g. \"u%%04d\" or \"u%%04d@d%%04d\"\n"
 " RANGE = range for templated usernames [1-%u] or domain names [1-%u]\n"
 " FILE = file of username:passwd pairs (instead of user/users/domains)\n"
-" MBOX = path to mbox from which we read mails to append.\n"
+" MBOX = path to mbox or maildir/directory from which we read mails to append.\n"
+" MB   = max. megabytes of CRLF-converted mbox messages to cache. [%u]\n"
 " MAILBOX = Mailbox name where to do all the work (default = INBOX).\n"
 " DESTBOX = Mailbox name where to copy messages.\n"
 " CC   = number of concurrent clients. [%u]\n"
+" N    = number of worker processes to split the clients between.\n"
+" RATE = open-loop mode: send this many commands per second in total.\n"
+" DEPTH = max number of commands each client pipelines. [%u]\n"
 " NMSG = target number of messages in the mailbox. [%u]\n"
 " SEED = seed for PRNG to make test repeatable.\n"
 "\n"
 " -    = Sets all probabilities to 0%% except for LOGIN, LOGOUT and SELECT\n"
 " <state> = Sets state's probability to n%% and repeated probability to m%%\n",
-	USER_RAND, DOMAIN_RAND,
-	CLIENTS_COUNT, MESSAGE_COUNT_THRESHOLD);
+	USER_RAND, DOMAIN_RAND, MSG_CACHE_MB,
+	CLIENTS_COUNT, MAX_COMMAND_QUEUE_LEN, MESSAGE_COUNT_THRESHOLD);
 }
 static void
 parse_possible_range(const char *value, unsigned int *start_r, unsigned int *count_r)
@@ -477,6 +823,46 @@ parse_possible_range(const char *value, unsigned int *start_r, unsigned int *cou
 	*count_r = num + 1 - *start_r;
 }
 
+static void
+parse_report_window(const char *value, unsigned int *from_r,
+		    unsigned int *to_r)
+{
+	const char *p = strchr(value, '-');
+
+	/* either side may be empty: "-3600" or "86400-" */
+	if (p == NULL ||
+	    (p != value && str_to_uint(t_strdup_until(value, p), from_r) < 0) ||
+	    (p[1] != '\0' && str_to_uint(p + 1, to_r) < 0) ||
+	    (*to_r != 0 && *to_r <= *from_r))
+		i_fatal("Invalid report_window: %s", value);
+}
+
+static int
+imaptest_report(const char *path, unsigned int from_secs, unsigned int to_secs)
+{
+	struct latency_histogram *hists;
+	int secs;
+
+	hists = i_new(struct latency_histogram, STATE_COUNT);
+	secs = histogram_log_read(path, from_secs, to_secs, hists);
+	if (secs < 0) {
+		i_free(hists);
+		return 1;
+	}
+
+	printf("%s: %d secs", path, secs);
+	if (from_secs != 0 || to_secs != 0) {
+		printf(", window %u-", from_secs);
+		if (to_secs != 0)
+			printf("%u", to_secs);
+		printf(" secs");
+	}
+	printf("\n");
+	print_latencies_table("Latency", hists);
+	i_free(hists);
+	return 0;
+}
+
 static
 int count_printf_ints(const char *s, const char **error_r)
 {
@@ -526,15 +912,12 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	struct state *state;
 	struct profile *profile = NULL;
 	const char *error, *key, *value, *hostip = NULL, *testpath = NULL;
-	unsigned int i;
+	const char *reportpath = NULL;
+	bool selftest_server = FALSE;
+	unsigned int i, stop_secs = 0, report_from = 0, report_to = 0;
 	int ret, fd;
 
 	lib_init();
-	ioloop = io_loop_create();
-
-	lib_signals_init();
-	lib_signals_ignore(SIGPIPE, TRUE);
-	lib_signals_set_handler(SIGINT, LIBSIG_FLAG_DELAYED, sig_die, NULL);
 
 	conf.password = PASSWORD;
 	conf.username_template = USERNAME_TEMPLATE;
@@ -548,6 +931,10 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	conf.domains_rand_start = 1;
 	conf.domains_rand_count = DOMAIN_RAND;
 	conf.mech = "LOGIN";
+	conf.pipeline_depth = MAX_COMMAND_QUEUE_LEN;
+	conf.pipeline_sweep_secs = PIPELINE_SWEEP_SECS;
+	conf.msg_cache_size = MSG_CACHE_MB * 1024ULL * 1024;
+	conf.overhead_warn_percent = OVERHEAD_WARN_PERCENT;
 	to_stop = NULL;
 
 	for (argv++; *argv != NULL; argv++) {
@@ -562,17 +949,15 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			return 0;
 		}
 		if (strcmp(key, "secs") == 0) {
-			unsigned int secs;
 			const char *p;
 
-			if (str_parse_uint(value, &secs, &p) < 0)
+			if (str_parse_uint(value, &stop_secs, &p) < 0)
 				i_fatal("Invalid secs: %s", value);
 			if (p[0] == '\0')
 				final_wait_secs = 30;
 			else if (p[0] != ',' ||
 				 str_to_uint(p+1, &final_wait_secs) < 0)
 				i_fatal("Invalid secs: %s", value);
-			to_stop = timeout_add(secs * 1000, timeout_stop, NULL);
 			continue;
 		}
 		if (strcmp(key, "seed") == 0) {
@@ -619,6 +1004,11 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.no_tracking = TRUE;
 			continue;
 		}
+		if (strcmp(*argv, "benchmark") == 0) {
+			conf.benchmark = TRUE;
+			conf.no_tracking = TRUE;
+			continue;
+		}
 		if (strcmp(*argv, "disconnect_quit") == 0) {
 			conf.disconnect_quit = TRUE;
 			continue;
@@ -631,6 +1021,10 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.rawlog = TRUE;
 			continue;
 		}
+		if (strcmp(*argv, "selftest_server") == 0) {
+			selftest_server = TRUE;
+			continue;
+		}
 		if (strcmp(*argv, "own_msgs") == 0) {
 			conf.own_msgs = TRUE;
 			continue;
@@ -672,6 +1066,86 @@ int main(int argc ATTR_UNUSED, char *argv[])
 				i_fatal("Invalid random_msg_size: %s", value);
 			continue;
 		}
+		/* random_msg_type=garbage|rfc822 */
+		if (strcmp(key, "random_msg_type") == 0) {
+			if (strcmp(value, "garbage") == 0)
+				conf.random_msg_rfc822 = FALSE;
+			else if (strcmp(value, "rfc822") == 0)
+				conf.random_msg_rfc822 = TRUE;
+			else
+				i_fatal("Invalid random_msg_type: %s", value);
+			continue;
+		}
+		/* random_msg_dist=uniform|exponential */
+		if (strcmp(key, "random_msg_dist") == 0) {
+			if (strcmp(value, "uniform") == 0)
+				conf.random_msg_size_exp = FALSE;
+			else if (strcmp(value, "exponential") == 0)
+				conf.random_msg_size_exp = TRUE;
+			else
+				i_fatal("Invalid random_msg_dist: %s", value);
+			continue;
+		}
+		/* msg_sizes=size:weight,... */
+		if (strcmp(key, "msg_sizes") == 0) {
+			conf_parse_msg_sizes(value);
+			continue;
+		}
+		/* msg_cache=MB */
+		if (strcmp(key, "msg_cache") == 0) {
+			if (str_to_uoff(value, &conf.msg_cache_size) < 0)
+				i_fatal("Invalid msg_cache: %s", value);
+			conf.msg_cache_size *= 1024 * 1024;
+			continue;
+		}
+
+		/* pipeline=# */
+		if (strcmp(key, "pipeline") == 0) {
+			if (str_to_uint(value, &conf.pipeline_depth) < 0 ||
+			    conf.pipeline_depth == 0)
+				i_fatal("Invalid pipeline: %s", value);
+			continue;
+		}
+		/* pipeline_sweep=#,#,.. */
+		if (strcmp(key, "pipeline_sweep") == 0) {
+			conf_parse_pipeline_sweep(value);
+			continue;
+		}
+		/* pipeline_sweep_secs=# */
+		if (strcmp(key, "pipeline_sweep_secs") == 0) {
+			if (str_to_uint(value, &conf.pipeline_sweep_secs) < 0)
+				i_fatal("Invalid pipeline_sweep_secs: %s", value);
+			continue;
+		}
+		/* rate=# */
+		if (strcmp(key, "rate") == 0) {
+			if (str_to_uint(value, &conf.arrival_rate) < 0)
+				i_fatal("Invalid rate: %s", value);
+			continue;
+		}
+		/* arrival=poisson|constant */
+		if (strcmp(key, "arrival") == 0) {
+			if (strcmp(value, "poisson") == 0)
+				conf.arrival_constant = FALSE;
+			else if (strcmp(value, "constant") == 0)
+				conf.arrival_constant = TRUE;
+			else
+				i_fatal("Invalid arrival: %s", value);
+			continue;
+		}
+
+		/* latency_breakdown=profile,ip */
+		if (strcmp(key, "latency_breakdown") == 0) {
+			conf_parse_latency_breakdown(value);
+			continue;
+		}
+
+		/* workers=# */
+		if (strcmp(key, "workers") == 0) {
+			if (str_to_uint(value, &conf.workers_count) < 0)
+				i_fatal("Invalid workers: %s", value);
+			continue;
+		}
 
 		/* clients=# */
 		if (strcmp(key, "clients") == 0) {
@@ -709,6 +1183,40 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			conf.stalled_disconnect_timeout = atoi(value);
 			continue;
 		}
+		/* histogram_log=path */
+		if (strcmp(key, "histogram_log") == 0) {
+			conf.histogram_log_path = value;
+			continue;
+		}
+		/* report=path */
+		if (strcmp(key, "report") == 0) {
+			reportpath = value;
+			continue;
+		}
+		/* report_window=from-to */
+		if (strcmp(key, "report_window") == 0) {
+			parse_report_window(value, &report_from, &report_to);
+			continue;
+		}
+		/* overhead_warn=percent */
+		if (strcmp(key, "overhead_warn") == 0) {
+			if (str_to_uint(value, &conf.overhead_warn_percent) < 0)
+				i_fatal("Invalid overhead_warn: %s", value);
+			continue;
+		}
+		/* stats_json=path */
+		if (strcmp(key, "stats_json") == 0) {
+			conf.stats_json_path = value;
+			continue;
+		}
+		/* stats_http=port */
+		if (strcmp(key, "stats_http") == 0) {
+			if (str_to_uint(value, &conf.stats_http_port) < 0 ||
+			    conf.stats_http_port == 0 ||
+			    conf.stats_http_port > 65535)
+				i_fatal("Invalid stats_http port: %s", value);
+			continue;
+		}
 
 		/* box=mailbox */
 		if (strcmp(key, "box") == 0) {
@@ -743,7 +1251,9 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			continue;
 		}
 		if (strcmp(key, "userfile") == 0) {
-			conf_read_usernames(value);
+			if (conf.userfile != NULL)
+				userfile_free(&conf.userfile);
+			conf.userfile = userfile_load(value);
 			continue;
 		}
 		if (strcmp(key, "master") == 0) {
@@ -793,6 +1303,8 @@ int main(int argc ATTR_UNUSED, char *argv[])
 
 		i_fatal("Unknown arg: %s", *argv);
 	}
+	if (reportpath != NULL)
+		return imaptest_report(reportpath, report_from, report_to);
 	if (conf.mailbox == NULL)
 		conf.mailbox = testpath == NULL ? "INBOX" : "imaptest";
 
@@ -801,6 +1313,21 @@ int main(int argc ATTR_UNUSED, char *argv[])
 	if (testpath != NULL && strchr(conf.username_template, '%') != NULL)
 		i_fatal("Don't use %% in username with tests");
 
+	if (conf.benchmark &&
+	    (testpath != NULL || conf.checkpoint_interval > 0 ||
+	     conf.own_msgs || conf.own_flags))
+		i_fatal("benchmark can't be used with test, checkpoint, "
+			"own_msgs or own_flags");
+	if (selftest_server) {
+		if (testpath != NULL)
+			i_fatal("selftest_server can't be used with test");
+		/* the canned server speaks only plaintext */
+		if (conf.ssl)
+			i_fatal("selftest_server can't be used with ssl");
+		/* fork before the workers, so they all connect to it */
+		selftest_server_fork();
+		hostip = NULL;
+	}
 	if (hostip == NULL)
 		hostip = conf.host;
 	if ((ret = net_gethostbyname(hostip, &conf.ips,
@@ -809,34 +1336,56 @@ int main(int argc ATTR_UNUSED, char *argv[])
 			hostip, net_gethosterror(ret));
 	}
 
+	fix_probabilities();
+	latency_breakdown_init(profile);
+	if (array_is_created(&conf.pipeline_sweep_depths) &&
+	    (profile != NULL || testpath != NULL || conf.workers_count > 1 ||
+	     conf.no_pipelining))
+		i_fatal("pipeline_sweep can't be used with profile, test, "
+			"workers or no_pipelining");
+	if (conf.workers_count > 1) {
+		if (testpath != NULL)
+			i_fatal("workers can't be used with test");
+		/* fork before creating the ioloop, so the workers don't
+		   share its epoll/kqueue fd */
+		if (workers_fork(profile) && results_output != NULL)
+			o_stream_destroy(&results_output);
+	}
+
+	ioloop = io_loop_create();
+
+	lib_signals_init();
+	lib_signals_ignore(SIGPIPE, TRUE);
+	lib_signals_set_handler(SIGINT, LIBSIG_FLAG_DELAYED, sig_die, NULL);
+	/* each worker stops itself, the parent waits for them */
+	if (stop_secs > 0 && !workers_is_parent())
+		to_stop = timeout_add(stop_secs * 1000, timeout_stop, NULL);
+
 	lib_set_clean_exit(TRUE);
 	if (results_output != NULL)
 		print_results_header();
-	fix_probabilities();
-	mailbox_source = imaptest_mailbox_source();
-	users_init(profile, mailbox_source);
-	mailboxes_init();
-	clients_init();
 	dsasl_clients_init();
 #ifdef STATIC_OPENSSL
 	ssl_iostream_openssl_init();
 #endif
 
-	i_array_init(&clients, CLIENTS_COUNT);
-	if (testpath == NULL)
-		imaptest_run();
+	workers_init();
+	stats_export_init();
+	histogram_log_init();
+	selftest_server_init();
+	overhead_init();
+	if (workers_is_parent())
+		imaptest_run_workers();
 	else
-		imaptest_run_tests(testpath);
-
-	imaptest_lmtp_delivery_deinit();
-	clients_deinit();
-	mailboxes_deinit();
-	users_deinit();
-	if (profile != NULL) {
+		imaptest_run_clients(profile, testpath);
+	histogram_log_deinit();
+	stats_export_deinit();
+	workers_deinit();
+	selftest_server_deinit();
+	latency_breakdown_deinit();
+	return_value = I_MAX(return_value, workers_get_exit_code());
+	if (profile != NULL)
 		pool_unref(&profile->pool);
-		profile_deinit();
-	}
-	mailbox_source_unref(&mailbox_source);
 
 	if (to_stop != NULL)
 		timeout_remove(&to_stop);
@@ -0,0 +1,221 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "str.h"
+#include "net.h"
+
+#include "settings.h"
+#include "profile.h"
+#include "latency-histogram.h"
+#include "latency-breakdown.h"
+
+static ARRAY(struct latency_breakdown) breakdowns;
+static const struct profile *breakdown_profile;
+/* number of values in each dimension, 1 if the dimension isn't used */
+static unsigned int users_count, clients_count, ips_count;
+
+static const char *
+latency_breakdown_get_name(unsigned int user_idx, unsigned int client_idx,
+			   unsigned int ip_idx)
+{
+	struct profile_user *const *users;
+	struct profile_client *const *clients;
+	string_t *str = t_str_new(64);
+
+	if (conf.latency_breakdown_profile) {
+		users = array_front(&breakdown_profile->users);
+		clients = array_front(&breakdown_profile->clients);
+		str_printfa(str, "%s/%s/", users[user_idx]->name,
+			    clients[client_idx]->name);
+	}
+	if (conf.latency_breakdown_ip)
+		str_printfa(str, "%s/", net_ip2addr(&conf.ips[ip_idx]));
+	str_truncate(str, str_len(str) - 1);
+	return str_c(str);
+}
+
+void latency_breakdown_init(const struct profile *profile)
+{
+	struct latency_breakdown *breakdown;
+	unsigned int i, j, k;
+
+	if (!conf.latency_breakdown_profile && !conf.latency_breakdown_ip)
+		return;
+	if (conf.latency_breakdown_profile && profile == NULL)
+		i_fatal("latency_breakdown=profile requires profile");
+
+	breakdown_profile = profile;
+	users_count = clients_count = ips_count = 1;
+	if (conf.latency_breakdown_profile) {
+		users_count = array_count(&profile->users);
+		clients_count = array_count(&profile->clients);
+	}
+	if (conf.latency_breakdown_ip)
+		ips_count = conf.ips_count;
+
+	i_array_init(&breakdowns, users_count * clients_count * ips_count);
+	for (i = 0; i < users_count; i++) {
+		for (j = 0; j < clients_count; j++) {
+			for (k = 0; k < ips_count; k++) {
+				breakdown = array_append_space(&breakdowns);
+				breakdown->name = i_strdup(
+					latency_breakdown_get_name(i, j, k));
+			}
+		}
+	}
+}
+
+void latency_breakdown_deinit(void)
+{
+	struct latency_breakdown *breakdown;
+
+	if (!array_is_created(&breakdowns))
+		return;
+	array_foreach_modifiable(&breakdowns, breakdown) {
+		i_free(breakdown->name);
+		i_free(breakdown->latencies);
+		i_free(breakdown->total_latencies);
+	}
+	array_free(&breakdowns);
+}
+
+unsigned int latency_breakdown_count(void)
+{
+	return array_is_created(&breakdowns) ? array_count(&breakdowns) : 0;
+}
+
+const struct latency_breakdown *latency_breakdown_get(unsigned int idx)
+{
+	return array_idx(&breakdowns, idx);
+}
+
+static unsigned int
+latency_breakdown_find_idx(const struct user_client *uc)
+{
+	struct profile_user *const *users;
+	struct profile_client *const *clients;
+	unsigned int user_idx, client_idx;
+
+	if (!conf.latency_breakdown_profile || uc == NULL)
+		return 0;
+
+	users = array_front(&breakdown_profile->users);
+	for (user_idx = 0; user_idx < users_count; user_idx++) {
+		if (users[user_idx] == uc->user->profile)
+			break;
+	}
+	clients = array_front(&breakdown_profile->clients);
+	for (client_idx = 0; client_idx < clients_count; client_idx++) {
+		if (clients[client_idx] == uc->profile)
+			break;
+	}
+	i_assert(user_idx < users_count && client_idx < clients_count);
+	return user_idx * clients_count + client_idx;
+}
+
+unsigned int latency_breakdown_get_idx(const struct user_client *uc,
+				       unsigned int ip_idx)
+{
+	if (!array_is_created(&breakdowns))
+		return 0;
+	return latency_breakdown_find_idx(uc) * ips_count +
+		(conf.latency_breakdown_ip ? ip_idx : 0);
+}
+
+void latency_breakdown_add(unsigned int idx, enum client_state state,
+			   uint64_t usecs)
+{
+	struct latency_breakdown *breakdown;
+
+	if (!array_is_created(&breakdowns))
+		return;
+
+	breakdown = array_idx_modifiable(&breakdowns, idx);
+	if (breakdown->latencies == NULL) {
+		breakdown->latencies =
+			i_new(struct latency_histogram, STATE_COUNT);
+	}
+	latency_histogram_add(&breakdown->latencies[state], usecs);
+}
+
+void latency_breakdown_get_interval(unsigned int idx,
+				    struct latency_histogram *dest)
+{
+	const struct latency_breakdown *breakdown =
+		array_idx(&breakdowns, idx);
+	unsigned int i;
+
+	if (breakdown->latencies == NULL)
+		return;
+	for (i = 1; i < STATE_COUNT; i++)
+		latency_histogram_merge(dest, &breakdown->latencies[i]);
+}
+
+void latency_breakdown_update_totals(void)
+{
+	struct latency_breakdown *breakdown;
+	unsigned int i;
+
+	if (!array_is_created(&breakdowns))
+		return;
+
+	array_foreach_modifiable(&breakdowns, breakdown) {
+		if (breakdown->latencies == NULL)
+			continue;
+		if (breakdown->total_latencies == NULL) {
+			breakdown->total_latencies =
+				i_new(struct latency_histogram, STATE_COUNT);
+		}
+		for (i = 0; i < STATE_COUNT; i++) {
+			latency_histogram_merge(&breakdown->total_latencies[i],
+						&breakdown->latencies[i]);
+			latency_histogram_reset(&breakdown->latencies[i]);
+		}
+	}
+}
+
+void latency_breakdown_export(string_t *dest)
+{
+	struct latency_breakdown *breakdown;
+	unsigned int i;
+
+	if (!array_is_created(&breakdowns))
+		return;
+
+	array_foreach_modifiable(&breakdowns, breakdown) {
+		if (breakdown->latencies == NULL)
+			continue;
+		for (i = 0; i < STATE_COUNT; i++) {
+			if (breakdown->latencies[i].count == 0)
+				continue;
+			str_printfa(dest, "breakdown\t%u\t%u\t",
+				    array_foreach_idx(&breakdowns, breakdown),
+				    i);
+			latency_histogram_export(&breakdown->latencies[i],
+						 dest);
+			str_append_c(dest, '\n');
+			latency_histogram_reset(&breakdown->latencies[i]);
+		}
+	}
+}
+
+int latency_breakdown_import(const char *const *args)
+{
+	struct latency_breakdown *breakdown;
+	unsigned int idx, state;
+
+	/* <idx> <state> <hist> */
+	if (str_array_length(args) != 3 ||
+	    str_to_uint(args[0], &idx) < 0 ||
+	    idx >= latency_breakdown_count() ||
+	    str_to_uint(args[1], &state) < 0 || state >= STATE_COUNT)
+		return -1;
+
+	breakdown = array_idx_modifiable(&breakdowns, idx);
+	if (breakdown->latencies == NULL) {
+		breakdown->latencies =
+			i_new(struct latency_histogram, STATE_COUNT);
+	}
+	return latency_histogram_import(&breakdown->latencies[state], args[2]);
+}
@@ -0,0 +1,47 @@
+#ifndef LATENCY_BREAKDOWN_H
+#define LATENCY_BREAKDOWN_H
+
+#include "client-state.h"
+
+struct profile;
+struct user_client;
+
+/* Command latencies split into dimensions by the connection's profile user
+   and client (latency_breakdown=profile) and/or by the server IP
+   (latency_breakdown=ip), so it's visible which population of clients has
+   the slowest commands. */
+struct latency_breakdown {
+	/* e.g. "user/client/ip" */
+	char *name;
+	/* STATE_COUNT histograms each, NULL until the first latency */
+	struct latency_histogram *latencies, *total_latencies;
+};
+
+/* Must be called after conf.ips is known. Does nothing if
+   latency_breakdown isn't set. */
+void latency_breakdown_init(const struct profile *profile);
+void latency_breakdown_deinit(void);
+
+/* Returns the number of dimensions, 0 if the breakdown isn't enabled. */
+unsigned int latency_breakdown_count(void);
+const struct latency_breakdown *latency_breakdown_get(unsigned int idx);
+/* Returns the dimension for a new connection. uc may be NULL. */
+unsigned int latency_breakdown_get_idx(const struct user_client *uc,
+				       unsigned int ip_idx);
+
+void latency_breakdown_add(unsigned int idx, enum client_state state,
+			   uint64_t usecs);
+/* Merge the latencies of all states in the current interval to dest. */
+void latency_breakdown_get_interval(unsigned int idx,
+				    struct latency_histogram *dest);
+/* Move the current interval's latencies to the totals. */
+void latency_breakdown_update_totals(void);
+
+/* Worker: append the current interval's latencies as "breakdown" lines and
+   reset them. */
+void latency_breakdown_export(string_t *dest);
+/* Parent: parse the arguments after "breakdown". Returns 0 on success,
+   -1 if they're invalid. */
+int latency_breakdown_import(const char *const *args);
+
+#endif
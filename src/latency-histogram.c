@@ -0,0 +1,153 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "bits.h"
+#include "str.h"
+#include "latency-histogram.h"
+
+#include <math.h>
+
+static unsigned int latency_histogram_bucket_idx(uint64_t usecs)
+{
+	unsigned int msb, group;
+
+	if (usecs < LATENCY_HISTOGRAM_SUB_COUNT)
+		return usecs;
+
+	msb = bits_required64(usecs) - 1;
+	if (msb >= LATENCY_HISTOGRAM_MAX_BITS)
+		return LATENCY_HISTOGRAM_BUCKET_COUNT - 1;
+
+	/* the highest bit is always set, so the next SUB_BITS bits
+	   select the linear bucket within this power of two */
+	group = msb - LATENCY_HISTOGRAM_SUB_BITS + 1;
+	return group * LATENCY_HISTOGRAM_SUB_COUNT +
+		((usecs >> (msb - LATENCY_HISTOGRAM_SUB_BITS)) &
+		 (LATENCY_HISTOGRAM_SUB_COUNT - 1));
+}
+
+static uint64_t latency_histogram_bucket_max_value(unsigned int idx)
+{
+	unsigned int group, sub, shift;
+
+	if (idx < LATENCY_HISTOGRAM_SUB_COUNT)
+		return idx;
+
+	group = idx / LATENCY_HISTOGRAM_SUB_COUNT;
+	sub = idx % LATENCY_HISTOGRAM_SUB_COUNT;
+	shift = group - 1;
+	return (((uint64_t)LATENCY_HISTOGRAM_SUB_COUNT + sub) << shift) +
+		((1ULL << shift) - 1);
+}
+
+void latency_histogram_reset(struct latency_histogram *hist)
+{
+	i_zero(hist);
+}
+
+void latency_histogram_add(struct latency_histogram *hist, uint64_t usecs)
+{
+	if (hist->count == 0 || hist->min > usecs)
+		hist->min = usecs;
+	if (hist->max < usecs)
+		hist->max = usecs;
+	hist->count++;
+	hist->sum += usecs;
+	hist->buckets[latency_histogram_bucket_idx(usecs)]++;
+}
+
+void latency_histogram_merge(struct latency_histogram *dest,
+			     const struct latency_histogram *src)
+{
+	unsigned int i;
+
+	if (src->count == 0)
+		return;
+
+	if (dest->count == 0 || dest->min > src->min)
+		dest->min = src->min;
+	if (dest->max < src->max)
+		dest->max = src->max;
+	dest->count += src->count;
+	dest->sum += src->sum;
+	for (i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; i++)
+		dest->buckets[i] += src->buckets[i];
+}
+
+uint64_t latency_histogram_get_percentile(const struct latency_histogram *hist,
+					  double percentile)
+{
+	uint64_t target, seen = 0, value;
+	unsigned int i;
+
+	if (hist->count == 0)
+		return 0;
+	if (percentile >= 100)
+		return hist->max;
+
+	target = (uint64_t)ceil(hist->count * percentile / 100.0);
+	if (target == 0)
+		target = 1;
+	for (i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; i++) {
+		seen += hist->buckets[i];
+		if (seen >= target)
+			break;
+	}
+	i_assert(i < LATENCY_HISTOGRAM_BUCKET_COUNT);
+	if (i == LATENCY_HISTOGRAM_BUCKET_COUNT - 1) {
+		/* the last bucket has no upper limit */
+		return hist->max;
+	}
+
+	/* report the bucket's highest value, but never more than what was
+	   actually seen */
+	value = latency_histogram_bucket_max_value(i);
+	return I_MIN(value, hist->max);
+}
+
+void latency_histogram_export(const struct latency_histogram *hist,
+			      string_t *dest)
+{
+	unsigned int i;
+
+	str_printfa(dest, "%llu,%llu,%llu,%llu",
+		    (unsigned long long)hist->count,
+		    (unsigned long long)hist->sum,
+		    (unsigned long long)hist->min,
+		    (unsigned long long)hist->max);
+	for (i = 0; i < LATENCY_HISTOGRAM_BUCKET_COUNT; i++) {
+		if (hist->buckets[i] != 0) {
+			str_printfa(dest, ",%u:%llu", i,
+				    (unsigned long long)hist->buckets[i]);
+		}
+	}
+}
+
+int latency_histogram_import(struct latency_histogram *hist, const char *data)
+{
+	struct latency_histogram imported;
+	const char *const *args, *p;
+	unsigned int idx;
+	uint64_t count;
+
+	i_zero(&imported);
+	args = t_strsplit(data, ",");
+	if (str_array_length(args) < 4 ||
+	    str_to_uint64(args[0], &imported.count) < 0 ||
+	    str_to_uint64(args[1], &imported.sum) < 0 ||
+	    str_to_uint64(args[2], &imported.min) < 0 ||
+	    str_to_uint64(args[3], &imported.max) < 0)
+		return -1;
+
+	for (args += 4; *args != NULL; args++) {
+		p = strchr(*args, ':');
+		if (p == NULL ||
+		    str_to_uint(t_strdup_until(*args, p), &idx) < 0 ||
+		    idx >= LATENCY_HISTOGRAM_BUCKET_COUNT ||
+		    str_to_uint64(p + 1, &count) < 0)
+			return -1;
+		imported.buckets[idx] += count;
+	}
+	latency_histogram_merge(hist, &imported);
+	return 0;
+}
@@ -0,0 +1,43 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+/* Log-linear histogram of latencies in microseconds. Values below
+   LATENCY_HISTOGRAM_SUB_COUNT are counted exactly. After that each power of
+   two is split into LATENCY_HISTOGRAM_SUB_COUNT linear buckets, so the
+   relative error of any reported value stays below 1/32. */
+#define LATENCY_HISTOGRAM_SUB_BITS 5
+#define LATENCY_HISTOGRAM_SUB_COUNT (1U << LATENCY_HISTOGRAM_SUB_BITS)
+/* Values larger than 2^40 usecs (~12 days) go to the last bucket. */
+#define LATENCY_HISTOGRAM_MAX_BITS 40
+#define LATENCY_HISTOGRAM_BUCKET_COUNT \
+	((LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BITS + 1) * \
+	 LATENCY_HISTOGRAM_SUB_COUNT)
+
+struct latency_histogram {
+	uint64_t count;
+	/* sum of all added values, for calculating the mean */
+	uint64_t sum;
+	uint64_t min, max;
+
+	uint64_t buckets[LATENCY_HISTOGRAM_BUCKET_COUNT];
+};
+
+void latency_histogram_reset(struct latency_histogram *hist);
+void latency_histogram_add(struct latency_histogram *hist, uint64_t usecs);
+void latency_histogram_merge(struct latency_histogram *dest,
+			     const struct latency_histogram *src);
+
+/* Returns the value below or at which the given percentage (0..100) of
+   values are. Returns 0 if the histogram is empty. */
+uint64_t latency_histogram_get_percentile(const struct latency_histogram *hist,
+					  double percentile);
+
+/* Append the histogram to dest as a single line of text that doesn't
+   contain tabs or LFs. Only the non-empty buckets are written. */
+void latency_histogram_export(const struct latency_histogram *hist,
+			      string_t *dest);
+/* Parse a histogram written by latency_histogram_export() and merge it into
+   hist. Returns 0 on success, -1 if the data is invalid. */
+int latency_histogram_import(struct latency_histogram *hist, const char *data);
+
+#endif
@@ -0,0 +1,272 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "hash.h"
+#include "istream.h"
+#include "istream-crlf.h"
+#include "mailbox.h"
+#include "mailbox-source-private.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+
+struct dir_mailbox_source_msg {
+	const char *path;
+	time_t mtime;
+	uoff_t size;
+	/* size with all LFs converted to CRLFs, (uoff_t)-1 if not known yet */
+	uoff_t vsize;
+};
+
+struct dir_mailbox_source {
+	struct mailbox_source source;
+
+	char *path;
+	pool_t pool;
+	ARRAY(struct dir_mailbox_source_msg) msgs;
+	unsigned int next_idx;
+};
+
+static void dir_mailbox_source_free(struct mailbox_source *_source)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	if (array_is_created(&source->msgs))
+		array_free(&source->msgs);
+	pool_unref(&source->pool);
+	i_free(source->path);
+	i_free(source);
+}
+
+static bool dir_mailbox_source_skip_file(const char *name)
+{
+	/* dotfiles and maildir's control files */
+	return name[0] == '.' || str_begins_with(name, "dovecot") ||
+		strcmp(name, "subscriptions") == 0 ||
+		strcmp(name, "maildirfolder") == 0;
+}
+
+static uoff_t dir_mailbox_source_filename_vsize(const char *name)
+{
+	const char *p, *end;
+	uoff_t vsize;
+
+	/* maildir filenames often contain the CRLF size as ",W=<vsize>" */
+	p = strstr(name, ",W=");
+	if (p == NULL)
+		return (uoff_t)-1;
+	p += 3;
+	for (end = p; *end >= '0' && *end <= '9'; end++) ;
+	if (end == p || str_to_uoff(t_strdup_until(p, end), &vsize) < 0)
+		return (uoff_t)-1;
+	return vsize;
+}
+
+static void
+dir_mailbox_source_scan(struct dir_mailbox_source *source, const char *path);
+
+static void
+dir_mailbox_source_add(struct dir_mailbox_source *source,
+		       const char *dir, const char *name)
+{
+	struct dir_mailbox_source_msg *msg;
+	const char *path = t_strdup_printf("%s/%s", dir, name);
+	struct stat st;
+
+	if (lstat(path, &st) < 0)
+		i_fatal("lstat(%s) failed: %m", path);
+	if (S_ISLNK(st.st_mode)) {
+		/* follow symlinks to messages, but not to directories,
+		   which could point back to a parent and loop forever */
+		if (stat(path, &st) < 0)
+			i_fatal("stat(%s) failed: %m", path);
+		if (S_ISDIR(st.st_mode))
+			return;
+	}
+	if (S_ISDIR(st.st_mode)) {
+		/* maildir's tmp/ has only partially written files.
+		   Maildir++ folders beginning with '.' are scanned. */
+		if (strcmp(name, "tmp") != 0)
+			dir_mailbox_source_scan(source, path);
+	} else if (S_ISREG(st.st_mode) && st.st_size > 0 &&
+		   !dir_mailbox_source_skip_file(name)) {
+		msg = array_append_space(&source->msgs);
+		msg->path = p_strdup(source->pool, path);
+		msg->mtime = st.st_mtime;
+		msg->size = st.st_size;
+		msg->vsize = dir_mailbox_source_filename_vsize(name);
+	}
+}
+
+static void
+dir_mailbox_source_scan(struct dir_mailbox_source *source, const char *path)
+{
+	struct dirent *d;
+	DIR *dir;
+
+	dir = opendir(path);
+	if (dir == NULL)
+		i_fatal("opendir(%s) failed: %m", path);
+
+	while ((d = readdir(dir)) != NULL) {
+		if (strcmp(d->d_name, ".") == 0 || strcmp(d->d_name, "..") == 0)
+			continue;
+		T_BEGIN {
+			dir_mailbox_source_add(source, path, d->d_name);
+		} T_END;
+	}
+	if (closedir(dir) < 0)
+		i_error("closedir(%s) failed: %m", path);
+}
+
+static int
+dir_mailbox_source_msg_cmp(const struct dir_mailbox_source_msg *msg1,
+			   const struct dir_mailbox_source_msg *msg2)
+{
+	return strcmp(msg1->path, msg2->path);
+}
+
+static void dir_mailbox_source_open(struct dir_mailbox_source *source)
+{
+	if (array_is_created(&source->msgs))
+		return;
+
+	i_array_init(&source->msgs, 1024);
+	dir_mailbox_source_scan(source, source->path);
+	if (array_count(&source->msgs) == 0)
+		i_fatal("No messages found in directory: %s", source->path);
+	/* readdir() order is random, but appends should be repeatable */
+	array_sort(&source->msgs, dir_mailbox_source_msg_cmp);
+}
+
+static uoff_t dir_mailbox_source_get_vsize(int fd, const char *path)
+{
+	unsigned char buf[IO_BLOCK_SIZE];
+	unsigned char last_char = '\0';
+	uoff_t vsize = 0;
+	ssize_t ret, i;
+
+	while ((ret = read(fd, buf, sizeof(buf))) > 0) {
+		for (i = 0; i < ret; i++) {
+			if (buf[i] == '\n' &&
+			    (i > 0 ? buf[i-1] : last_char) != '\r')
+				vsize++;
+		}
+		vsize += ret;
+		last_char = buf[ret-1];
+	}
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", path);
+	if (lseek(fd, 0, SEEK_SET) < 0)
+		i_fatal("lseek(%s) failed: %m", path);
+	return vsize;
+}
+
+static bool dir_mailbox_source_eof(struct mailbox_source *_source)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	dir_mailbox_source_open(source);
+	return source->next_idx >= array_count(&source->msgs);
+}
+
+static unsigned int
+dir_mailbox_source_get_msg_count(struct mailbox_source *_source)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	dir_mailbox_source_open(source);
+	return array_count(&source->msgs);
+}
+
+static uoff_t
+dir_mailbox_source_get_msg_size(struct mailbox_source *_source,
+				unsigned int idx)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+	const struct dir_mailbox_source_msg *msg;
+
+	dir_mailbox_source_open(source);
+	msg = array_idx(&source->msgs, idx);
+	/* the file size is close enough, if vsize isn't known yet */
+	return msg->vsize != (uoff_t)-1 ? msg->vsize : msg->size;
+}
+
+static struct istream *
+dir_mailbox_source_get_msg(struct mailbox_source *_source, unsigned int idx,
+			   uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+	struct dir_mailbox_source_msg *msg;
+	struct istream *input, *input2;
+	int fd;
+
+	dir_mailbox_source_open(source);
+	msg = array_idx_modifiable(&source->msgs, idx);
+
+	fd = open(msg->path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", msg->path);
+	if (msg->vsize == (uoff_t)-1) {
+		/* read the file only the first time it's used */
+		msg->vsize = dir_mailbox_source_get_vsize(fd, msg->path);
+	}
+
+	*vsize_r = msg->vsize;
+	*time_r = msg->mtime;
+	*tz_offset_r = 0;
+
+	input = i_stream_create_fd_autoclose(&fd, IO_BLOCK_SIZE);
+	i_stream_set_name(input, msg->path);
+	if (msg->vsize == msg->size) {
+		/* already has CRLFs. sending the file stream directly allows
+		   ostream to use sendfile() for non-SSL connections. */
+		return input;
+	}
+	input2 = i_stream_create_crlf(input);
+	i_stream_unref(&input);
+	return input2;
+}
+
+static struct istream *
+dir_mailbox_source_get_next(struct mailbox_source *_source,
+			    uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+{
+	struct dir_mailbox_source *source =
+		(struct dir_mailbox_source *)_source;
+
+	dir_mailbox_source_open(source);
+	if (source->next_idx >= array_count(&source->msgs))
+		source->next_idx = 0;
+	return dir_mailbox_source_get_msg(_source, source->next_idx++,
+					  vsize_r, time_r, tz_offset_r);
+}
+
+static const struct mailbox_source_vfuncs dir_mailbox_source_vfuncs = {
+	dir_mailbox_source_free,
+	dir_mailbox_source_eof,
+	dir_mailbox_source_get_next,
+	dir_mailbox_source_get_msg_count,
+	dir_mailbox_source_get_msg_size,
+	dir_mailbox_source_get_msg,
+};
+
+struct mailbox_source *mailbox_source_new_dir(const char *path)
+{
+	struct dir_mailbox_source *source;
+
+	source = i_new(struct dir_mailbox_source, 1);
+	source->path = i_strdup(path);
+	source->pool = pool_alloconly_create("dir mailbox source", 1024*64);
+	source->source.v = dir_mailbox_source_vfuncs;
+	mailbox_source_init(&source->source);
+	return &source->source;
+}
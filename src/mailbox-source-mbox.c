@@ -1,48 +1,135 @@
 /* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "hash.h"
+#include "mmap-util.h"
 #include "istream.h"
 #include "istream-crlf.h"
 #include "mbox-from.h"
+#include "settings.h"
 #include "mailbox.h"
 #include "mailbox-source-private.h"
 
 #include <fcntl.h>
 #include <unistd.h>
+#include <sys/stat.h>
+
+struct mbox_mailbox_source_msg {
+	/* offset and size of the message body after the From-line */
+	uoff_t offset, size;
+	/* size with all LFs converted to CRLFs */
+	uoff_t vsize;
+	time_t time;
+	int tz_offset;
+	/* the message converted to CRLFs (vsize bytes), NULL if not cached */
+	unsigned char *crlf_data;
+};
 
 struct mbox_mailbox_source {
 	struct mailbox_source source;
 
-	int fd;
 	char *path;
-	struct istream *input;
-	uoff_t next_offset;
+	/* kept open for sending messages with sendfile() */
+	int fd;
+	const unsigned char *mmap_base;
+	size_t mmap_size;
+
+	ARRAY(struct mbox_mailbox_source_msg) msgs;
+	unsigned int next_idx;
+	/* total size of the cached crlf_data */
+	uoff_t cache_size;
 };
 
 static void mbox_mailbox_source_free(struct mailbox_source *_source)
 {
 	struct mbox_mailbox_source *source =
 		(struct mbox_mailbox_source *)_source;
+	struct mbox_mailbox_source_msg *msg;
 
-	if (source->input != NULL)
-		i_stream_unref(&source->input);
+	if (array_is_created(&source->msgs)) {
+		array_foreach_modifiable(&source->msgs, msg)
+			i_free(msg->crlf_data);
+	}
+	if (source->mmap_base != NULL) {
+		if (munmap((void *)source->mmap_base, source->mmap_size) < 0)
+			i_error("munmap(%s) failed: %m", source->path);
+	}
 	if (source->fd != -1)
 		i_close_fd(&source->fd);
+	if (array_is_created(&source->msgs))
+		array_free(&source->msgs);
 	i_free(source->path);
 	i_free(source);
 }
 
+static void mbox_mailbox_source_index(struct mbox_mailbox_source *source)
+{
+	const unsigned char *data = source->mmap_base, *line, *lf;
+	struct mbox_mailbox_source_msg *msg = NULL;
+	size_t size = source->mmap_size, pos, next_pos, linelen;
+	time_t t;
+	int tz;
+	char *sender;
+
+	i_array_init(&source->msgs, 1024);
+	for (pos = 0; pos < size; pos = next_pos) {
+		line = data + pos;
+		lf = memchr(line, '\n', size - pos);
+		next_pos = lf == NULL ? size : (size_t)(lf - data) + 1;
+		linelen = (lf == NULL ? size : (size_t)(lf - data)) - pos;
+		if (linelen > 0 && line[linelen-1] == '\r')
+			linelen--;
+
+		/* a From-line right after another one is part of the body */
+		if (linelen >= 5 && memcmp(line, "From ", 5) == 0 &&
+		    (msg == NULL || msg->offset != pos) &&
+		    mbox_from_parse(line+5, linelen-5, &t, &tz, &sender) == 0) {
+			i_free(sender);
+			if (msg != NULL)
+				msg->size = pos - msg->offset;
+			msg = array_append_space(&source->msgs);
+			msg->offset = next_pos;
+			msg->time = t;
+			msg->tz_offset = tz;
+		} else if (msg == NULL) {
+			i_fatal("Not a valid mbox file: %s", source->path);
+		} else if (lf != NULL && (lf == data || lf[-1] != '\r')) {
+			/* LF will be converted to CRLF */
+			msg->vsize++;
+		}
+	}
+	i_assert(msg != NULL);
+	msg->size = size - msg->offset;
+	if (msg->size == 0)
+		i_fatal("mbox file ends with From-line: %s", source->path);
+
+	array_foreach_modifiable(&source->msgs, msg)
+		msg->vsize += msg->size;
+}
+
 static void mbox_mailbox_source_open(struct mbox_mailbox_source *source)
 {
-	if (source->fd != -1)
+	struct stat st;
+	void *mmap_base;
+
+	if (source->mmap_base != NULL)
 		return;
 
 	source->fd = open(source->path, O_RDONLY);
 	if (source->fd == -1)
 		i_fatal("open(%s) failed: %m", source->path);
-	source->input = i_stream_create_fd(source->fd, (size_t)-1);
-	i_stream_set_name(source->input, source->path);
+	if (fstat(source->fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", source->path);
+	if (st.st_size == 0)
+		i_fatal("Empty mbox file: %s", source->path);
+
+	mmap_base = mmap_ro_file(source->fd, &source->mmap_size);
+	if (mmap_base == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", source->path);
+	source->mmap_base = mmap_base;
+
+	mbox_mailbox_source_index(source);
 }
 
 static bool mbox_mailbox_source_eof(struct mailbox_source *_source)
@@ -51,83 +138,136 @@ static bool mbox_mailbox_source_eof(struct mailbox_source *_source)
 		(struct mbox_mailbox_source *)_source;
 
 	mbox_mailbox_source_open(source);
-	return i_stream_read_eof(source->input);
+	return source->next_idx >= array_count(&source->msgs);
+}
+
+static void
+mbox_mailbox_source_cache(struct mbox_mailbox_source *source,
+			  struct mbox_mailbox_source_msg *msg)
+{
+	const unsigned char *data = source->mmap_base + msg->offset;
+	const unsigned char *end = data + msg->size, *lf;
+	unsigned char *dest;
+
+	/* messages are appended in the same order over and over again (or
+	   randomly with size sampling), so evicting anything would only cause
+	   more misses. just keep the first ones that fit. */
+	if (source->cache_size + msg->vsize > conf.msg_cache_size)
+		return;
+
+	dest = msg->crlf_data = i_malloc(msg->vsize);
+	while ((lf = memchr(data, '\n', end - data)) != NULL) {
+		memcpy(dest, data, lf - data);
+		dest += lf - data;
+		if (lf == source->mmap_base || lf[-1] != '\r')
+			*dest++ = '\r';
+		*dest++ = '\n';
+		data = lf + 1;
+	}
+	memcpy(dest, data, end - data);
+	dest += end - data;
+	i_assert(dest == msg->crlf_data + msg->vsize);
+
+	source->cache_size += msg->vsize;
+}
+
+static void mbox_mailbox_source_stream_destroyed(struct mailbox_source *source)
+{
+	mailbox_source_unref(&source);
+}
+
+static unsigned int
+mbox_mailbox_source_get_msg_count(struct mailbox_source *_source)
+{
+	struct mbox_mailbox_source *source =
+		(struct mbox_mailbox_source *)_source;
+
+	mbox_mailbox_source_open(source);
+	return array_count(&source->msgs);
+}
+
+static uoff_t
+mbox_mailbox_source_get_msg_size(struct mailbox_source *_source,
+				 unsigned int idx)
+{
+	struct mbox_mailbox_source *source =
+		(struct mbox_mailbox_source *)_source;
+
+	mbox_mailbox_source_open(source);
+	return array_idx(&source->msgs, idx)->vsize;
 }
 
 static struct istream *
-mbox_mailbox_source_get_next(struct mailbox_source *_source,
-			     uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+mbox_mailbox_source_get_msg(struct mailbox_source *_source, unsigned int idx,
+			    uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
 {
 	struct mbox_mailbox_source *source =
 		(struct mbox_mailbox_source *)_source;
-	const char *line;
-	char *sender;
-	uoff_t offset, last_offset, vsize;
-	time_t next_time;
-	unsigned int linelen;
-	int next_tz;
+	struct mbox_mailbox_source_msg *msg;
+	struct istream *input, *input2;
 
 	mbox_mailbox_source_open(source);
-	i_stream_seek(source->input, source->next_offset);
+	msg = array_idx_modifiable(&source->msgs, idx);
 
-	line = i_stream_read_next_line(source->input);
-	if (line == NULL) {
-		if (source->input->v_offset == 0)
-			i_fatal("Empty mbox file: %s", source->path);
+	*vsize_r = msg->vsize;
+	*time_r = msg->time;
+	*tz_offset_r = msg->tz_offset;
 
-		source->next_offset = 0;
-		return mbox_mailbox_source_get_next(_source, vsize_r,
-						    time_r, tz_offset_r);
+	if (msg->vsize == msg->size && !conf.ssl) {
+		/* already has CRLFs. send it from the file, so ostream can
+		   use sendfile() instead of copying it through our memory. */
+		input = i_stream_create_fd(source->fd, IO_BLOCK_SIZE);
+		input2 = i_stream_create_range(input, msg->offset, msg->size);
+		i_stream_unref(&input);
+	} else if (msg->vsize == msg->size) {
+		/* already has CRLFs */
+		input2 = i_stream_create_from_data(source->mmap_base +
+						   msg->offset, msg->size);
+	} else {
+		if (msg->crlf_data == NULL)
+			mbox_mailbox_source_cache(source, msg);
+		if (msg->crlf_data != NULL) {
+			input2 = i_stream_create_from_data(msg->crlf_data,
+							   msg->vsize);
+		} else {
+			input = i_stream_create_from_data(source->mmap_base +
+							  msg->offset,
+							  msg->size);
+			input2 = i_stream_create_crlf(input);
+			i_stream_unref(&input);
+		}
 	}
+	i_stream_set_name(input2, source->path);
 
-	/* should be From-line */
-	if (strncmp(line, "From ", 5) != 0 ||
-	    mbox_from_parse((const unsigned char *)line+5, strlen(line+5),
-			    time_r, tz_offset_r, &sender) < 0) {
-		if (source->input->v_offset == 0)
-			i_fatal("Not a valid mbox file: %s", source->path);
-		i_panic("From-line not found at %"PRIuUOFF_T,
-			source->input->v_offset);
-	}
-	i_free(sender);
-
-	vsize = 0;
-        offset = last_offset = source->input->v_offset;
-        while ((line = i_stream_read_next_line(source->input)) != NULL) {
-		linelen = strlen(line);
-		if (strncmp(line, "From ", 5) == 0 &&
-		    mbox_from_parse((const unsigned char *)line+5,
-				    linelen-5, &next_time, &next_tz,
-				    &sender) == 0) {
-			i_free(sender);
-			if (offset != last_offset)
-                                break;
-
-                        /* empty body */
-                        offset = last_offset;
-                }
-		vsize += linelen + 2; /* count lines always as CR+LFs */
-                last_offset = source->input->v_offset;
-        }
-        if (offset == last_offset)
-                i_fatal("mbox file ends with From-line: %s", source->path);
-
-	i_stream_seek(source->input, offset);
-
-	source->next_offset = last_offset;
-	*vsize_r = vsize;
-
-	struct istream *input =
-		i_stream_create_limit(source->input, last_offset - offset);
-	struct istream *input2 = i_stream_create_crlf(input);
-	i_stream_unref(&input);
+	/* the stream points to our memory or fd, so keep the source alive */
+	mailbox_source_ref(_source);
+	i_stream_add_destroy_callback(input2,
+				      mbox_mailbox_source_stream_destroyed,
+				      _source);
 	return input2;
 }
 
+static struct istream *
+mbox_mailbox_source_get_next(struct mailbox_source *_source,
+			     uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
+{
+	struct mbox_mailbox_source *source =
+		(struct mbox_mailbox_source *)_source;
+
+	mbox_mailbox_source_open(source);
+	if (source->next_idx >= array_count(&source->msgs))
+		source->next_idx = 0;
+	return mbox_mailbox_source_get_msg(_source, source->next_idx++,
+					   vsize_r, time_r, tz_offset_r);
+}
+
 static const struct mailbox_source_vfuncs mbox_mailbox_source_vfuncs = {
 	mbox_mailbox_source_free,
 	mbox_mailbox_source_eof,
 	mbox_mailbox_source_get_next,
+	mbox_mailbox_source_get_msg_count,
+	mbox_mailbox_source_get_msg_size,
+	mbox_mailbox_source_get_msg,
 };
 
 struct mailbox_source *mailbox_source_new_mbox(const char *path)
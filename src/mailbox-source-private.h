@@ -9,6 +9,19 @@ struct mailbox_source_vfuncs {
 	struct istream *(*get_next)(struct mailbox_source *source,
 				    uoff_t *vsize_r,
 				    time_t *time_r, int *tz_offset_r);
+
+	/* Optional, for sources with an index of messages. Required for
+	   size sampling. */
+	unsigned int (*get_msg_count)(struct mailbox_source *source);
+	uoff_t (*get_msg_size)(struct mailbox_source *source, unsigned int idx);
+	struct istream *(*get_msg)(struct mailbox_source *source,
+				   unsigned int idx, uoff_t *vsize_r,
+				   time_t *time_r, int *tz_offset_r);
+};
+
+struct mailbox_source_size_bucket {
+	unsigned int weight;
+	ARRAY_TYPE(uint) msgs;
 };
 
 struct mailbox_source {
@@ -17,6 +30,11 @@ struct mailbox_source {
 
 	pool_t messages_pool;
 	HASH_TABLE(char *, struct message_global *) messages;
+
+	bool size_sampling;
+	/* created on the first get_next() with size_sampling */
+	ARRAY(struct mailbox_source_size_bucket) size_buckets;
+	unsigned int size_buckets_total_weight;
 };
 
 void mailbox_source_init(struct mailbox_source *source);
@@ -2,19 +2,30 @@
 
 #include "lib.h"
 #include "hash.h"
+#include "str.h"
 #include "istream.h"
-#include "istream-crlf.h"
-#include "mbox-from.h"
+#include "message-date.h"
+#include "settings.h"
 #include "mailbox.h"
 #include "mailbox-source-private.h"
 
-#include <fcntl.h>
+#include <math.h>
 #include <unistd.h>
 #include <time.h>
 
+/* attach base64 data when the message is larger than this */
+#define RANDOM_MSG_ATTACHMENT_MIN_SIZE 4096
+#define RANDOM_MSG_LINE_LEN 76
+
+static const char base64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
 struct random_mailbox_source {
 	struct mailbox_source source;
 	size_t max_size;
+
+	uint64_t rand_state;
+	unsigned int msg_counter;
 };
 
 static void random_mailbox_source_free(struct mailbox_source *_source)
@@ -28,32 +39,197 @@ random_mailbox_source_eof(struct mailbox_source *_source ATTR_UNUSED)
 	return TRUE; /* shouldn't really matter */
 }
 
+static inline uint64_t random_msg_next(struct random_mailbox_source *source)
+{
+	/* xorshift64* - calling i_rand() for each byte is far too slow */
+	source->rand_state ^= source->rand_state >> 12;
+	source->rand_state ^= source->rand_state << 25;
+	source->rand_state ^= source->rand_state >> 27;
+	return source->rand_state * 0x2545F4914F6CDD1DULL;
+}
+
+static void
+random_msg_fill(struct random_mailbox_source *source,
+	    unsigned char *data, size_t size)
+{
+	uint64_t value;
+	size_t i;
+
+	for (i = 0; i + sizeof(value) <= size; i += sizeof(value)) {
+		value = random_msg_next(source);
+		memcpy(data + i, &value, sizeof(value));
+	}
+	if (i < size) {
+		value = random_msg_next(source);
+		memcpy(data + i, &value, size - i);
+	}
+}
+
+static size_t random_msg_get_size(struct random_mailbox_source *source)
+{
+	double randu, size;
+
+	if (source->max_size <= 1)
+		return 1;
+	if (!conf.random_msg_size_exp)
+		return random_msg_next(source) % source->max_size + 1;
+
+	/* exponentially distributed with mean max_size/4: mostly small
+	   messages with a long tail of large ones up to max_size */
+	randu = ((random_msg_next(source) >> 11) + 1.0) / 9007199254740993.0;
+	size = -log(randu) * source->max_size / 4;
+	return size >= source->max_size ? source->max_size : (size_t)size + 1;
+}
+
+static void
+random_msg_garbage(struct random_mailbox_source *source,
+		   string_t *str, size_t size)
+{
+	unsigned char *data;
+	size_t i;
+
+	data = buffer_append_space_unsafe(str, size);
+	random_msg_fill(source, data, size);
+	/* normalize any CR or LF into a CRLF pair */
+	for (i = 0; i < size; i++) {
+		if (data[i] != '\r' && data[i] != '\n')
+			continue;
+		if (i+1 == size)
+			data[i] = ' ';
+		else {
+			data[i] = '\r';
+			data[++i] = '\n';
+		}
+	}
+}
+
+static void
+random_msg_append_words(struct random_mailbox_source *source, string_t *str,
+		    size_t size, bool wrap)
+{
+	size_t start = str_len(str), line_start = start;
+	uint64_t value;
+	unsigned int i, word_len;
+
+	while (str_len(str) - start < size) {
+		value = random_msg_next(source);
+		word_len = 2 + (value & 7);
+		value >>= 3;
+		if (str_len(str) != line_start)
+			str_append_c(str, ' ');
+		for (i = 0; i < word_len; i++) {
+			str_append_c(str, 'a' + value % 26);
+			value /= 26;
+		}
+		if (wrap &&
+		    str_len(str) - line_start >= RANDOM_MSG_LINE_LEN - 10) {
+			str_append(str, "\r\n");
+			line_start = str_len(str);
+		}
+	}
+	if (wrap && str_len(str) != line_start)
+		str_append(str, "\r\n");
+}
+
+static void
+random_msg_append_base64(struct random_mailbox_source *source, string_t *str,
+		     size_t size)
+{
+	unsigned char *data;
+	size_t i, line_len;
+
+	/* random base64 characters are just as good as base64-encoded
+	   random data, and much cheaper to create */
+	while (size > 0) {
+		line_len = I_MIN(size, RANDOM_MSG_LINE_LEN);
+		line_len = (line_len + 3) / 4 * 4;
+		data = buffer_append_space_unsafe(str, line_len);
+		random_msg_fill(source, data, line_len);
+		for (i = 0; i < line_len; i++)
+			data[i] = base64_chars[data[i] & 63];
+		str_append(str, "\r\n");
+		size -= I_MIN(size, line_len);
+	}
+}
+
+static void
+random_msg_rfc822(struct random_mailbox_source *source,
+		  string_t *str, size_t size, time_t t)
+{
+	size_t text_size, attachment_size = 0;
+	unsigned int id = source->msg_counter++;
+
+	str_printfa(str, "Message-ID: <imaptest.%ld.%u.%llu@example.org>\r\n",
+		    (long)getpid(), id,
+		    (unsigned long long)random_msg_next(source));
+	str_printfa(str, "Date: %s\r\n", message_date_create(t));
+	str_printfa(str, "From: user%u@example.org\r\n",
+		    (unsigned int)(random_msg_next(source) % 1000));
+	str_printfa(str, "To: user%u@example.org\r\n",
+		    (unsigned int)(random_msg_next(source) % 1000));
+	str_append(str, "Subject: ");
+	random_msg_append_words(source, str, 10 + random_msg_next(source) % 50,
+				FALSE);
+	str_append(str, "\r\nMIME-Version: 1.0\r\n");
+
+	if (size > str_len(str) + RANDOM_MSG_ATTACHMENT_MIN_SIZE) {
+		/* text part of 1/4 of the body, the rest as attachment */
+		text_size = (size - str_len(str)) / 4;
+		attachment_size = size - str_len(str) - text_size;
+		str_printfa(str, "Content-Type: multipart/mixed; "
+			    "boundary=\"imaptest-%u\"\r\n\r\n"
+			    "--imaptest-%u\r\n"
+			    "Content-Type: text/plain; "
+			    "charset=us-ascii\r\n\r\n",
+			    id, id);
+	} else {
+		str_append(str, "Content-Type: text/plain; "
+			   "charset=us-ascii\r\n\r\n");
+		text_size = size > str_len(str) ? size - str_len(str) : 1;
+	}
+	random_msg_append_words(source, str, text_size, TRUE);
+
+	if (attachment_size > 0) {
+		str_printfa(str, "\r\n--imaptest-%u\r\n"
+			    "Content-Type: application/octet-stream\r\n"
+			    "Content-Transfer-Encoding: base64\r\n"
+			    "Content-Disposition: attachment; "
+			    "filename=\"random-%u.bin\"\r\n\r\n", id, id);
+		random_msg_append_base64(source, str, attachment_size);
+		str_printfa(str, "\r\n--imaptest-%u--\r\n", id);
+	}
+}
+
+static void random_mailbox_source_stream_destroyed(string_t *str)
+{
+	str_free(&str);
+}
+
 static struct istream *
 random_mailbox_source_get_next(struct mailbox_source *_source,
 			       uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
 {
 	struct random_mailbox_source *source =
 		(struct random_mailbox_source *)_source;
-	size_t buf_size = i_rand_limit(source->max_size) + 1;
-	unsigned char *buf = i_malloc(buf_size);
-	for (size_t i = 0; i < buf_size; i++) {
-		buf[i] = i_rand_limit(256);
-		if (buf[i] == '\r' || buf[i] == '\n') {
-			if (i+1 == buf_size)
-				buf[i] = ' ';
-			else {
-				buf[i] = '\r';
-				buf[++i] = '\n';
-			}
-		}
-	}
+	size_t size = random_msg_get_size(source);
+	time_t t = time(NULL);
+	string_t *str;
+
+	str = str_new(default_pool, size + 1024);
+	if (conf.random_msg_rfc822)
+		random_msg_rfc822(source, str, size, t);
+	else
+		random_msg_garbage(source, str, size);
 
+	/* the stream owns the buffer, so it doesn't need to be copied */
 	struct istream *input =
-		i_stream_create_copy_from_data(buf, buf_size);
-	i_free(buf);
-	*time_r = time(NULL);
+		i_stream_create_from_data(str_data(str), str_len(str));
+	i_stream_add_destroy_callback(input,
+				      random_mailbox_source_stream_destroyed,
+				      str);
+	*time_r = t;
 	*tz_offset_r = 0;
-	*vsize_r = buf_size;
+	*vsize_r = str_len(str);
 	return input;
 }
 
@@ -69,6 +245,11 @@ struct mailbox_source *mailbox_source_new_random(size_t max_size)
 
 	source = i_new(struct random_mailbox_source, 1);
 	source->max_size = max_size;
+	/* seeded from i_rand(), so seed=n still makes the messages
+	   repeatable. the state must never be 0. */
+	source->rand_state = ((uint64_t)i_rand() << 32) ^ i_rand();
+	if (source->rand_state == 0)
+		source->rand_state = 1;
 	source->source.v = random_mailbox_source_vfuncs;
 	mailbox_source_init(&source->source);
 	return &source->source;
@@ -1,7 +1,10 @@
 /* Copyright (c) 2007-2018 ImapTest authors, see the included COPYING file */
 
 #include "lib.h"
+#include "array.h"
 #include "hash.h"
+#include "istream.h"
+#include "settings.h"
 #include "mailbox.h"
 #include "mailbox-source-private.h"
 
@@ -14,6 +17,73 @@ void mailbox_source_init(struct mailbox_source *source)
 	hash_table_create(&source->messages, default_pool, 0, str_hash, strcmp);
 }
 
+bool mailbox_source_enable_size_sampling(struct mailbox_source *source)
+{
+	if (source->v.get_msg == NULL)
+		return FALSE;
+	source->size_sampling = TRUE;
+	return TRUE;
+}
+
+static void mailbox_source_size_buckets_init(struct mailbox_source *source)
+{
+	const struct msg_size_weight *sizes;
+	struct mailbox_source_size_bucket *buckets;
+	unsigned int i, idx, msg_count, sizes_count;
+	uoff_t size;
+
+	sizes = array_get(&conf.msg_sizes, &sizes_count);
+	i_array_init(&source->size_buckets, sizes_count);
+	for (i = 0; i < sizes_count; i++) {
+		buckets = array_append_space(&source->size_buckets);
+		buckets->weight = sizes[i].weight;
+		i_array_init(&buckets->msgs, 64);
+		source->size_buckets_total_weight += sizes[i].weight;
+	}
+	buckets = array_idx_modifiable(&source->size_buckets, 0);
+
+	/* sizes are sorted. each message goes to the first bucket it fits
+	   in, and the last bucket gets also all the larger messages. */
+	msg_count = source->v.get_msg_count(source);
+	for (idx = 0; idx < msg_count; idx++) {
+		size = source->v.get_msg_size(source, idx);
+		for (i = 0; i + 1 < sizes_count; i++) {
+			if (size <= sizes[i].max_size)
+				break;
+		}
+		array_append(&buckets[i].msgs, &idx, 1);
+	}
+
+	for (i = 0; i < sizes_count; i++) {
+		if (buckets[i].weight > 0 && array_count(&buckets[i].msgs) == 0) {
+			i_fatal("msg_sizes: No messages with size up to "
+				"%"PRIuUOFF_T" bytes found", sizes[i].max_size);
+		}
+	}
+}
+
+static struct istream *
+mailbox_source_get_next_sample(struct mailbox_source *source,
+			       uoff_t *vsize_r, time_t *time_r,
+			       int *tz_offset_r)
+{
+	const struct mailbox_source_size_bucket *bucket;
+	unsigned int weight, msg_idx;
+
+	if (!array_is_created(&source->size_buckets))
+		mailbox_source_size_buckets_init(source);
+
+	weight = i_rand_limit(source->size_buckets_total_weight);
+	array_foreach(&source->size_buckets, bucket) {
+		if (weight < bucket->weight)
+			break;
+		weight -= bucket->weight;
+	}
+	msg_idx = *array_idx(&bucket->msgs,
+			     i_rand_limit(array_count(&bucket->msgs)));
+	return source->v.get_msg(source, msg_idx, vsize_r, time_r, tz_offset_r);
+}
+
 void mailbox_source_ref(struct mailbox_source *source)
 {
 	i_assert(source->refcount > 0);
@@ -29,6 +99,13 @@ void mailbox_source_unref(struct mailbox_source **_source)
 	if (--source->refcount > 0)
 		return;
 
+	if (array_is_created(&source->size_buckets)) {
+		struct mailbox_source_size_bucket *bucket;
+
+		array_foreach_modifiable(&source->size_buckets, bucket)
+			array_free(&bucket->msgs);
+		array_free(&source->size_buckets);
+	}
 	hash_table_destroy(&source->messages);
 	pool_unref(&source->messages_pool);
 	source->v.free(source);
@@ -43,6 +120,10 @@ struct istream *
 mailbox_source_get_next(struct mailbox_source *source,
 			uoff_t *vsize_r, time_t *time_r, int *tz_offset_r)
 {
+	if (source->size_sampling) {
+		return mailbox_source_get_next_sample(source, vsize_r,
+						      time_r, tz_offset_r);
+	}
 	return source->v.get_next(source, vsize_r, time_r, tz_offset_r);
 }
 
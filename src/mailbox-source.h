@@ -4,7 +4,13 @@
 extern struct mailbox_source *mailbox_source;
 
 struct mailbox_source *mailbox_source_new_mbox(const char *path);
+/* Messages from a maildir or a directory (tree) of message files */
+struct mailbox_source *mailbox_source_new_dir(const char *path);
 struct mailbox_source *mailbox_source_new_random(size_t max_size);
+/* Pick the messages randomly according to conf.msg_sizes instead of
+   sequentially. Returns FALSE if the source has no index of messages to
+   sample from (random messages). */
+bool mailbox_source_enable_size_sampling(struct mailbox_source *source);
 void mailbox_source_ref(struct mailbox_source *source);
 void mailbox_source_unref(struct mailbox_source **source);
 
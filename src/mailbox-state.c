@@ -15,6 +15,7 @@
 #include "mailbox.h"
 #include "mailbox-source.h"
 #include "mailbox-state.h"
+#include "overhead.h"
 
 #include <stdlib.h>
 
@@ -485,7 +486,8 @@ static void fetch_parse_body1(struct imap_client *client, const struct imap_arg
 	}
 }
 
-void mailbox_state_handle_fetch(struct imap_client *client, unsigned int seq,
+static void
+mailbox_state_handle_fetch_real(struct imap_client *client, unsigned int seq,
 				const struct imap_arg *args)
 {
 	struct mailbox_view *view = client->view;
@@ -722,6 +724,15 @@ void mailbox_state_handle_fetch(struct imap_client *client, unsigned int seq,
 	}
 }
 
+void mailbox_state_handle_fetch(struct imap_client *client, unsigned int seq,
+				const struct imap_arg *args)
+{
+	enum overhead_type prev = overhead_begin(OVERHEAD_FETCH_VERIFY);
+
+	mailbox_state_handle_fetch_real(client, seq, args);
+	overhead_end(prev);
+}
+
 int mailbox_state_set_flags(struct mailbox_view *view,
 			    const struct imap_arg *args,
 			    bool imap4rev2_enabled)
@@ -191,12 +191,59 @@ mailbox_keywords_drop(struct mailbox_view *view, const uint8_t *bitmask)
 	}
 }
 
+static unsigned int
+mailbox_view_seq_to_idx(struct mailbox_view *view, unsigned int seq)
+{
+	if (seq - 1 < view->expunge_pending_idx)
+		return seq - 1;
+	return seq - 1 + view->expunge_pending_count;
+}
+
+unsigned int mailbox_view_get_msgs_count(struct mailbox_view *view)
+{
+	return array_count(&view->uidmap) - view->expunge_pending_count;
+}
+
+struct message_metadata_dynamic *
+mailbox_view_get_metadata(struct mailbox_view *view, unsigned int seq)
+{
+	return array_idx_get_space(&view->messages,
+				   mailbox_view_seq_to_idx(view, seq));
+}
+
+void mailbox_view_expunge_flush(struct mailbox_view *view)
+{
+	unsigned int idx = view->expunge_pending_idx;
+	unsigned int count = view->expunge_pending_count;
+
+	if (count == 0)
+		return;
+
+	array_delete(&view->uidmap, idx, count);
+	i_assert(array_count(&view->messages) >= idx + count);
+	array_delete(&view->messages, idx, count);
+	view->expunge_pending_idx = 0;
+	view->expunge_pending_count = 0;
+}
+
 void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq)
 {
 	struct message_metadata_dynamic *metadata;
 	const uint32_t *uidp;
+	unsigned int idx;
 
-	metadata = array_idx_modifiable(&view->messages, seq - 1);
+	/* keep the pending expunges as a single run: the message must be
+	   right before or right after it */
+	if (seq - 1 != view->expunge_pending_idx &&
+	    seq != view->expunge_pending_idx)
+		mailbox_view_expunge_flush(view);
+	idx = mailbox_view_seq_to_idx(view, seq);
+	if (view->expunge_pending_count == 0 ||
+	    idx < view->expunge_pending_idx)
+		view->expunge_pending_idx = idx;
+	view->expunge_pending_count++;
+
+	metadata = array_idx_get_space(&view->messages, idx);
 	if (metadata->keyword_bitmask != NULL)
 		mailbox_keywords_drop(view, metadata->keyword_bitmask);
 	i_free(metadata->keyword_bitmask);
@@ -207,13 +254,11 @@ void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq)
 		metadata->ms->expunged = TRUE;
 		message_metadata_static_unref(view->storage, &metadata->ms);
 	}
-	uidp = array_idx(&view->uidmap, seq-1);
+	uidp = array_idx(&view->uidmap, idx);
 	if (*uidp != 0)
 		view->known_uid_count--;
-	array_delete(&view->uidmap, seq - 1, 1);
-	array_delete(&view->messages, seq - 1, 1);
 
-	if (array_count(&view->uidmap) == 0)
+	if (mailbox_view_get_msgs_count(view) == 0)
 		view->storage->seen_all_recent = TRUE;
 }
 
@@ -648,6 +693,7 @@ bool mailbox_view_save_offline_cache(struct mailbox_view *view)
 	struct message_metadata_dynamic new_metadata;
 	unsigned int i, count, keyword_bytecount;
 
+	mailbox_view_expunge_flush(view);
 	if (view->known_uid_count != array_count(&view->uidmap)) {
 		/* some UIDs are not known, can't really handle this */
 		return FALSE;
@@ -762,6 +808,7 @@ void mailbox_view_free(struct mailbox_view **_mailbox)
 
 	*_mailbox = NULL;
 
+	mailbox_view_expunge_flush(view);
 	mailbox_metadata_free(view->storage, &view->messages);
 	array_free(&view->messages);
 	array_free(&view->keywords);
@@ -174,6 +174,10 @@ struct mailbox_view {
 	ARRAY_TYPE(message_metadata_dynamic) messages;
 	/* number of non-zero UIDs in uidmap. */
 	unsigned int known_uid_count;
+	/* Expunged messages at uidmap/messages indexes
+	   [expunge_pending_idx, expunge_pending_idx + expunge_pending_count)
+	   that haven't been removed from the arrays yet. */
+	unsigned int expunge_pending_idx, expunge_pending_count;
 
 	bool readwrite:1;
 	bool keywords_can_create_more:1;
@@ -231,7 +235,18 @@ void message_metadata_static_assign_owner(struct mailbox_storage *storage,
 					  struct message_metadata_static *ms);
 void message_metadata_static_unref(struct mailbox_storage *storage,
 				   struct message_metadata_static **ms);
+/* Expunge the message with the given sequence. Expunges of adjacent messages
+   (e.g. "* 5 EXPUNGE" repeated, or descending sequences) are batched: they
+   stay in uidmap and messages until a non-adjacent message is expunged or
+   mailbox_view_expunge_flush() is called. Until then only the functions
+   below may be used to access the view. */
 void mailbox_view_expunge(struct mailbox_view *view, unsigned int seq);
+void mailbox_view_expunge_flush(struct mailbox_view *view);
+/* Returns the number of messages, excluding the pending expunges. */
+unsigned int mailbox_view_get_msgs_count(struct mailbox_view *view);
+/* Returns the metadata of the given sequence, skipping pending expunges. */
+struct message_metadata_dynamic *
+mailbox_view_get_metadata(struct mailbox_view *view, unsigned int seq);
 
 bool mailbox_global_get_sent_date(struct mailbox_source *source,
 				  struct message_global *msg,
@@ -0,0 +1,124 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "str.h"
+
+#include "client-state.h"
+#include "workers.h"
+#include "overhead.h"
+
+#include <sys/resource.h>
+
+const char *const overhead_names[OVERHEAD_COUNT] = {
+	"parse",
+	"verify",
+	"send",
+	"checkpoint",
+};
+
+static struct overhead_stats interval;
+/* OVERHEAD_COUNT when not inside any of the hot paths */
+static enum overhead_type cur_type = OVERHEAD_COUNT;
+static uint64_t cur_start_usecs;
+
+static uint64_t last_wait_usecs, last_cpu_usecs, last_usecs;
+
+enum overhead_type overhead_begin(enum overhead_type type)
+{
+	enum overhead_type prev = cur_type;
+	uint64_t now = client_state_get_timer_usecs();
+
+	if (cur_type != OVERHEAD_COUNT)
+		interval.usecs[cur_type] += now - cur_start_usecs;
+	cur_type = type;
+	cur_start_usecs = now;
+	return prev;
+}
+
+void overhead_end(enum overhead_type prev)
+{
+	uint64_t now = client_state_get_timer_usecs();
+
+	i_assert(cur_type != OVERHEAD_COUNT);
+	interval.usecs[cur_type] += now - cur_start_usecs;
+	cur_type = prev;
+	cur_start_usecs = now;
+}
+
+static uint64_t overhead_get_cpu_usecs(void)
+{
+	struct rusage ru;
+
+	if (getrusage(RUSAGE_SELF, &ru) < 0)
+		i_fatal("getrusage() failed: %m");
+	return (uint64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+		ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+void overhead_init(void)
+{
+	last_wait_usecs = io_loop_get_wait_usecs(current_ioloop);
+	last_cpu_usecs = overhead_get_cpu_usecs();
+	last_usecs = client_state_get_timer_usecs();
+}
+
+void overhead_get_interval(struct overhead_stats *stats_r)
+{
+	uint64_t now, wait_usecs, cpu_usecs;
+
+	if (!workers_is_parent()) {
+		/* the parent only collects the workers' statistics, so its
+		   own waiting and CPU usage aren't interesting */
+		now = client_state_get_timer_usecs();
+		wait_usecs = io_loop_get_wait_usecs(current_ioloop);
+		cpu_usecs = overhead_get_cpu_usecs();
+
+		interval.wait_usecs = wait_usecs - last_wait_usecs;
+		if (now > last_usecs) {
+			interval.cpu_percent = (cpu_usecs - last_cpu_usecs) *
+				100 / (now - last_usecs);
+		}
+		last_wait_usecs = wait_usecs;
+		last_cpu_usecs = cpu_usecs;
+		last_usecs = now;
+	}
+	*stats_r = interval;
+	i_zero(&interval);
+}
+
+void overhead_export(string_t *dest)
+{
+	struct overhead_stats stats;
+	unsigned int i;
+
+	overhead_get_interval(&stats);
+	str_append(dest, "overhead");
+	for (i = 0; i < OVERHEAD_COUNT; i++)
+		str_printfa(dest, "\t%llu", (unsigned long long)stats.usecs[i]);
+	str_printfa(dest, "\t%llu\t%u\n", (unsigned long long)stats.wait_usecs,
+		    stats.cpu_percent);
+}
+
+int overhead_import(const char *const *args)
+{
+	struct overhead_stats stats;
+	unsigned int i;
+
+	/* <usecs for each type> <wait usecs> <cpu percent> */
+	if (str_array_length(args) != OVERHEAD_COUNT + 2)
+		return -1;
+	for (i = 0; i < OVERHEAD_COUNT; i++) {
+		if (str_to_uint64(args[i], &stats.usecs[i]) < 0)
+			return -1;
+	}
+	if (str_to_uint64(args[i], &stats.wait_usecs) < 0 ||
+	    str_to_uint(args[i+1], &stats.cpu_percent) < 0)
+		return -1;
+
+	for (i = 0; i < OVERHEAD_COUNT; i++)
+		interval.usecs[i] += stats.usecs[i];
+	interval.wait_usecs += stats.wait_usecs;
+	interval.cpu_percent = I_MAX(interval.cpu_percent, stats.cpu_percent);
+	return 0;
+}
@@ -0,0 +1,49 @@
+#ifndef OVERHEAD_H
+#define OVERHEAD_H
+
+/* imaptest's own hot paths. Each is timed exclusive of the others, e.g.
+   the FETCH verification done while parsing the input isn't counted as
+   parsing. */
+enum overhead_type {
+	/* imap_client_input() */
+	OVERHEAD_INPUT_PARSE,
+	/* mailbox_state_handle_fetch() */
+	OVERHEAD_FETCH_VERIFY,
+	/* command_send_binary() */
+	OVERHEAD_COMMAND_SEND,
+	/* checkpoint_neg() */
+	OVERHEAD_CHECKPOINT,
+
+	OVERHEAD_COUNT
+};
+
+struct overhead_stats {
+	uint64_t usecs[OVERHEAD_COUNT];
+	/* time spent waiting for I/O in the ioloop */
+	uint64_t wait_usecs;
+	/* CPU usage of the busiest client process during the interval */
+	unsigned int cpu_percent;
+};
+
+extern const char *const overhead_names[OVERHEAD_COUNT];
+
+/* Start counting time to the given type. Returns the previous type, which
+   must be given to overhead_end(). */
+enum overhead_type overhead_begin(enum overhead_type type);
+void overhead_end(enum overhead_type prev);
+
+/* Start measuring the ioloop wait and CPU usage. Must be called after the
+   ioloop has been created. */
+void overhead_init(void);
+
+/* Get the statistics since the previous call and reset them. */
+void overhead_get_interval(struct overhead_stats *stats_r);
+
+/* Worker: append the current interval's statistics as an "overhead" line
+   and reset them. */
+void overhead_export(string_t *dest);
+/* Parent: parse the arguments after "overhead". Returns 0 on success, -1 if
+   they're invalid. */
+int overhead_import(const char *const *args);
+
+#endif
@@ -0,0 +1,111 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+
+#include "settings.h"
+#include "client-state.h"
+#include "pipeline-sweep.h"
+
+#include <stdio.h>
+
+/* ignore the first second after changing the depth, since the clients still
+   have commands pipelined with the previous depth */
+#define PIPELINE_SWEEP_WARMUP_SECS 1
+
+struct pipeline_sweep_step {
+	unsigned int depth;
+	/* number of seconds measured */
+	unsigned int secs;
+	struct latency_histogram latencies;
+};
+
+static ARRAY(struct pipeline_sweep_step *) steps;
+static unsigned int step_idx, step_secs;
+static bool sweep_running = FALSE;
+static void (*sweep_finished_callback)(void);
+
+void pipeline_sweep_init(void (*finished_callback)(void))
+{
+	struct pipeline_sweep_step *step;
+	const unsigned int *depth;
+
+	if (!array_is_created(&conf.pipeline_sweep_depths))
+		return;
+	if (conf.pipeline_sweep_secs <= PIPELINE_SWEEP_WARMUP_SECS) {
+		i_fatal("pipeline_sweep_secs must be larger than %u",
+			PIPELINE_SWEEP_WARMUP_SECS);
+	}
+
+	i_array_init(&steps, array_count(&conf.pipeline_sweep_depths));
+	array_foreach(&conf.pipeline_sweep_depths, depth) {
+		step = i_new(struct pipeline_sweep_step, 1);
+		step->depth = *depth;
+		array_append(&steps, &step, 1);
+	}
+	sweep_finished_callback = finished_callback;
+	sweep_running = TRUE;
+	step_idx = 0;
+	step_secs = 0;
+	conf.pipeline_depth = (*array_idx(&steps, 0))->depth;
+}
+
+void pipeline_sweep_deinit(void)
+{
+	struct pipeline_sweep_step **step;
+
+	if (!array_is_created(&steps))
+		return;
+	array_foreach_modifiable(&steps, step)
+		i_free(*step);
+	array_free(&steps);
+}
+
+void pipeline_sweep_add_latencies(const struct latency_histogram *hists)
+{
+	struct pipeline_sweep_step *step;
+	unsigned int i;
+
+	if (!sweep_running)
+		return;
+
+	step = *array_idx(&steps, step_idx);
+	if (step_secs++ >= PIPELINE_SWEEP_WARMUP_SECS) {
+		for (i = 1; i < STATE_COUNT; i++)
+			latency_histogram_merge(&step->latencies, &hists[i]);
+		step->secs++;
+	}
+	if (step_secs < conf.pipeline_sweep_secs)
+		return;
+
+	step_secs = 0;
+	if (++step_idx < array_count(&steps)) {
+		conf.pipeline_depth = (*array_idx(&steps, step_idx))->depth;
+		return;
+	}
+	sweep_running = FALSE;
+	sweep_finished_callback();
+}
+
+void pipeline_sweep_print(void)
+{
+	struct pipeline_sweep_step *const *stepp;
+	const struct latency_histogram *hist;
+
+	if (!array_is_created(&steps))
+		return;
+
+	printf("\nPipelining depth sweep:\n%8s %10s %9s %9s %9s\n",
+	       "depth", "cmds/sec", "avg ms", "p50 ms", "p99 ms");
+	array_foreach(&steps, stepp) {
+		if ((*stepp)->secs == 0)
+			break;
+		hist = &(*stepp)->latencies;
+		printf("%8u %10.1f %9.3f %9.3f %9.3f\n", (*stepp)->depth,
+		       hist->count / (double)(*stepp)->secs,
+		       hist->count == 0 ? 0 :
+		       hist->sum / (double)hist->count / 1000,
+		       latency_histogram_get_percentile(hist, 50) / 1000.0,
+		       latency_histogram_get_percentile(hist, 99) / 1000.0);
+	}
+}
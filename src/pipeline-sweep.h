@@ -0,0 +1,19 @@
+#ifndef PIPELINE_SWEEP_H
+#define PIPELINE_SWEEP_H
+
+struct latency_histogram;
+
+/* Benchmark mode that runs each of conf.pipeline_sweep_depths for
+   conf.pipeline_sweep_secs and reports the throughput for each depth. */
+
+/* Start the sweep by setting the first pipelining depth. finished_callback
+   is called after the last depth has been measured. */
+void pipeline_sweep_init(void (*finished_callback)(void));
+void pipeline_sweep_deinit(void);
+
+/* Called once per second with the latencies of the last second. */
+void pipeline_sweep_add_latencies(const struct latency_histogram *hists);
+/* Print the throughput and latency for each measured depth. */
+void pipeline_sweep_print(void);
+
+#endif
@@ -49,7 +49,7 @@ static void pop3_command_send(struct pop3_client *client, const char *cmdline,
 	cmd->cmdline = i_strconcat(cmdline, "\r\n", NULL);
 	cmd->state = client->client.state;
 	cmd->callback = callback;
-	i_gettimeofday(&cmd->tv_start);
+	cmd->start_usecs = client_state_get_timer_usecs();
 
 	o_stream_nsend_str(client->client.output, cmd->cmdline);
 	array_append(&client->commands, &cmd, 1);
@@ -71,7 +71,8 @@ pop3_command_finish(struct pop3_client *client, struct pop3_command *cmd)
 	i_assert(i < count);
 
 	counters[cmd->state]++;
-	client_state_add_to_timer(cmd->state, &cmd->tv_start);
+	client_state_add_to_timer(&client->client, cmd->state,
+				  cmd->start_usecs, cmd->start_usecs);
 	pop3_command_free(cmd);
 }
 
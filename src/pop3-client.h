@@ -16,7 +16,7 @@ struct pop3_command {
 	enum client_state state;
 
 	pop3_command_callback_t *callback;
-	struct timeval tv_start;
+	uint64_t start_usecs;
 };
 
 struct pop3_client {
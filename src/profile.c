@@ -2,6 +2,7 @@
 
 #include "lib.h"
 #include "ioloop.h"
+#include "priorityq.h"
 #include "istream.h"
 #include "str.h"
 #include "var-expand.h"
@@ -9,10 +10,12 @@
 #include "imap-arg.h"
 #include "imap-quote.h"
 #include "imap-client.h"
+#include "settings.h"
 #include "mailbox.h"
 #include "mailbox-source.h"
 #include "commands.h"
 #include "imaptest-lmtp.h"
+#include "userfile.h"
 #include "profile.h"
 
 #include <stdlib.h>
@@ -21,15 +24,78 @@
 #define RANDU (i_rand_limit(RAND_MAX) / (double)RAND_MAX)
 #define RANDN2(mu, sigma) \
 	(mu + (i_rand_limit(2) != 0 ? -1.0 : 1.0) * sigma * pow(-log(0.99999*RANDU), 0.5))
-#define weighted_rand(n) \
-	(int)RANDN2(n, n/2)
-
-static time_t users_min_timestamp = INT_MAX;
+/* n is in seconds, but the result is in milliseconds so that the events are
+   spread evenly instead of being batched at each full second */
+#define weighted_rand_msecs(n) \
+	(int64_t)RANDN2((n)*1000.0, (n)*1000.0/2)
+
+/* how soon to run user events that are already due */
+#define USER_EVENT_DUE_DELAY_MSECS 500
+
+/* Users are kept in this struct-of-arrays form, indexed by their slot, so
+   that millions of users need only a few dozen bytes each. A struct user
+   is allocated only while the user is connected or running its events.
+   The mailbox caches, POP3 UIDLs and draft UID of a freed user are kept
+   in slot_states until it's allocated again. */
+struct user_slots {
+	unsigned int count;
+	/* msecs, -1 = none */
+	int64_t *timestamps[USER_TIMESTAMP_COUNT];
+	/* USER_SLOT_NOT_QUEUED if the slot isn't in users_queue */
+	int64_t *next_min_timestamp;
+	/* bitmask of the profile's clients the user has */
+	uint32_t *client_masks;
+	struct priorityq_item *queue_items;
+};
+#define USER_SLOT_NOT_QUEUED INT64_MAX
+#define USER_SLOT_MAX_CLIENTS 32
+
+/* slots [first_slot..first_slot+count) belong to user_profile */
+struct user_slot_range {
+	const struct profile_user *user_profile;
+	unsigned int first_slot, count;
+	/* NULL with username_format */
+	struct userfile *userfile;
+};
+
+/* Client state that must survive while the user isn't allocated, so the
+   next login continues from where the previous one left off */
+struct user_slot_client_state {
+	ARRAY(struct user_mailbox_cache) mailboxes;
+	pool_t pop3_uidls_pool;
+	ARRAY_TYPE(const_string) pop3_uidls;
+	uint32_t draft_uid;
+};
+
+struct user_slot_state {
+	pool_t pool;
+	/* in the same order as user->clients */
+	struct user_slot_client_state *clients;
+	unsigned int clients_count;
+};
+
+static struct user_slots slots;
+static ARRAY(struct user_slot_range) slot_ranges;
+/* slot+1 => allocated user */
+static HASH_TABLE(void *, struct user *) slot_users;
+/* slot+1 => state of an unallocated user, if it has any */
+static HASH_TABLE(void *, struct user_slot_state *) slot_states;
+/* bitmask of the profile's clients that are allowed any connections */
+static uint32_t slot_connectable_clients_mask;
+static struct profile *users_profile;
+static struct mailbox_source *users_source;
+
+/* user slots sorted by next_min_timestamp */
+static struct priorityq *users_queue;
 static struct timeout *to_users;
+/* when to_users triggers */
+static int64_t to_users_timestamp;
 
 static void user_mailbox_action_move(struct imap_client *client,
 				     const char *mailbox, uint32_t uid);
-static void user_set_min_timestamp(struct user *user, time_t min_timestamp);
+static void user_set_min_timestamp(struct user *user, int64_t min_timestamp);
+static void
+user_slot_set_min_timestamp(unsigned int slot, int64_t min_timestamp);
 static void users_timeout_update(void);
 
 static void client_profile_init_mailbox(struct imap_client *client)
@@ -70,7 +136,7 @@ int imap_client_profile_send_more_commands(struct client *_client)
 	struct imap_client *client = (struct imap_client *)_client;
 	string_t *cmd = t_str_new(128);
 
-	if (array_count(&client->commands) > 0)
+	if (client->commands_count > 0)
 		return 0;
 
 	switch (_client->login_state) {
@@ -150,9 +216,9 @@ static void client_profile_handle_fetch(struct imap_client *client,
 
 			if ((unsigned)i_rand() % 100 < client->client.user->profile->mail_inbox_move_filter_percentage)
 				user_mailbox_action_move(client, PROFILE_MAILBOX_SPAM, uid);
-			else if (cache->next_action_timestamp == (time_t)-1) {
-				cache->next_action_timestamp = ioloop_time +
-					weighted_rand(client->client.user->profile->mail_action_delay);
+			else if (cache->next_action_timestamp == -1) {
+				cache->next_action_timestamp = users_get_ioloop_msecs() +
+					weighted_rand_msecs(client->client.user->profile->mail_action_delay);
 				user_set_min_timestamp(client->client.user, cache->next_action_timestamp);
 			}
 		}
@@ -191,34 +257,35 @@ static struct imap_client *user_find_any_imap_client(struct user_client *uc)
 }
 
 static unsigned int
-user_get_timeout_interval(struct user *user, enum user_timestamp ts)
+user_get_timeout_interval(const struct profile_user *user_profile,
+			  enum user_timestamp ts)
 {
 	switch (ts) {
 	case USER_TIMESTAMP_LOGIN:
 		return 0;
 	case USER_TIMESTAMP_INBOX_DELIVERY:
-		return user->profile->mail_inbox_delivery_interval;
+		return user_profile->mail_inbox_delivery_interval;
 	case USER_TIMESTAMP_SPAM_DELIVERY:
-		return user->profile->mail_spam_delivery_interval;
+		return user_profile->mail_spam_delivery_interval;
 	case USER_TIMESTAMP_WRITE_MAIL:
-		return user->profile->mail_send_interval;
+		return user_profile->mail_send_interval;
 	case USER_TIMESTAMP_LOGOUT:
-		return user->profile->mail_session_length;
+		return user_profile->mail_session_length;
 	case USER_TIMESTAMP_COUNT:
 		break;
 	}
 	i_unreached();
 }
 
-static time_t
-user_get_next_timeout(struct user *user, time_t start_time,
+static int64_t
+user_get_next_timeout(struct user *user, int64_t start_time,
 		      enum user_timestamp ts)
 {
-	unsigned int interval = user_get_timeout_interval(user, ts);
+	unsigned int interval = user_get_timeout_interval(user->profile, ts);
 
 	if (interval == 0)
-		return (time_t)-1;
-	return start_time + weighted_rand(interval);
+		return -1;
+	return start_time + weighted_rand_msecs(interval);
 }
 
 static void user_mailbox_action_delete(struct imap_client *client, uint32_t uid)
@@ -258,7 +325,7 @@ static void user_draft_callback(struct imap_client *client, struct command *cmd,
 {
 	const char *uidvalidity, *uidstr;
 	uint32_t uid;
-	time_t ts;
+	int64_t ts;
 
 	i_assert(cmd == client->client.user_client->draft_cmd);
 	client->client.user_client->draft_cmd = NULL;
@@ -279,7 +346,8 @@ static void user_draft_callback(struct imap_client *client, struct command *cmd,
 	i_assert(client->client.user_client->draft_uid == 0);
 	client->client.user_client->draft_uid = uid;
 
-	ts = ioloop_time + weighted_rand(client->client.user->profile->mail_write_duration);
+	ts = users_get_ioloop_msecs() +
+		weighted_rand_msecs(client->client.user->profile->mail_write_duration);
 	client->client.user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = ts;
 	user_set_min_timestamp(client->client.user, ts);
 }
@@ -301,7 +369,7 @@ static bool user_write_mail(struct user_client *uc)
 			return TRUE;
 
 		/* disable WRITE_MAIL timeout until writing is finished */
-		uc->user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = (time_t)-1;
+		uc->user->timestamps[USER_TIMESTAMP_WRITE_MAIL] = -1;
 		imap_client_append_full(client, PROFILE_MAILBOX_DRAFTS,
 					"\\Draft", "",
 					user_draft_callback, &uc->draft_cmd);
@@ -420,14 +488,15 @@ static bool user_client_is_connected(struct user_client *uc)
 static void user_set_next_mailbox_action(struct user *user)
 {
 	struct user_mailbox_cache *mailbox;
+	int64_t now = users_get_ioloop_msecs();
 
 	array_foreach_elem(&user->active_client->mailboxes, mailbox) {
-		if (mailbox->next_action_timestamp <= ioloop_time &&
-		    mailbox->next_action_timestamp != (time_t)-1) {
+		if (mailbox->next_action_timestamp <= now &&
+		    mailbox->next_action_timestamp != -1) {
 			mailbox->next_action_timestamp =
 				user_mailbox_action(user, mailbox) ?
-				(ioloop_time + weighted_rand(user->profile->mail_action_repeat_delay)) :
-				(time_t)-1;
+				(now + weighted_rand_msecs(user->profile->mail_action_repeat_delay)) :
+				-1;
 		}
 		user_set_min_timestamp(user, mailbox->next_action_timestamp);
 	}
@@ -448,9 +517,11 @@ static void user_logout(struct user_client *uc)
 static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 				 bool user_connected)
 {
-	if (user->timestamps[ts] > ioloop_time)
+	int64_t now = users_get_ioloop_msecs();
+
+	if (user->timestamps[ts] > now)
 		return -1;
-	if (user->timestamps[ts] == (time_t)-1) {
+	if (user->timestamps[ts] == -1) {
 		if (ts == USER_TIMESTAMP_LOGIN) {
 			user->timestamps[ts] = user_get_next_login_time(user);
 			user_set_min_timestamp(user, user->timestamps[ts]);
@@ -458,7 +529,7 @@ static int user_timestamp_handle(struct user *user, enum user_timestamp ts,
 			/* have to have a logout timestamp when there are
 			   connected clients. */
 			user->timestamps[ts] =
-				user_get_next_timeout(user, ioloop_time, ts);
+				user_get_next_timeout(user, now, ts);
 			i_assert(user->timestamps[ts] > 0);
 		}
 		return -1;
@@ -505,17 +576,19 @@ static void user_run_actions(struct user *user)
 		return;
 	}
 
-	user->next_min_timestamp = INT_MAX;
+	/* users_timeout() already removed the user from the queue */
+	i_assert(slots.next_min_timestamp[user->profile_slot] ==
+		 USER_SLOT_NOT_QUEUED);
 	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++) {
 		switch (user_timestamp_handle(user, ts, user_connected)) {
 		case -1:
 			break;
 		case 0:
-			user->timestamps[ts] = (time_t)-1;
+			user->timestamps[ts] = -1;
 			break;
 		case 1:
-			user->timestamps[ts] =
-				user_get_next_timeout(user, ioloop_time, ts);
+			user->timestamps[ts] = user_get_next_timeout(user,
+				users_get_ioloop_msecs(), ts);
 			break;
 		}
 		user_set_min_timestamp(user, user->timestamps[ts]);
@@ -524,34 +597,335 @@ static void user_run_actions(struct user *user)
 		user_set_next_mailbox_action(user);
 }
 
-static void user_fill_timestamps(struct user *user, time_t start_time)
+static void
+user_add_client_profile(struct user *user, struct profile_client *profile)
+{
+	struct user_client *uc;
+
+	uc = p_new(user->pool, struct user_client, 1);
+	uc->user = user;
+	uc->profile = profile;
+	p_array_init(&uc->clients, user->pool, 4);
+	p_array_init(&uc->mailboxes, user->pool, 2);
+	array_append(&user->clients, &uc, 1);
+}
+
+static uint32_t user_get_random_client_mask(struct profile *profile)
+{
+	struct profile_client *const *clients;
+	unsigned int i, count;
+	uint32_t mask = 0;
+
+	clients = array_get(&profile->clients, &count);
+	while (mask == 0) {
+		for (i = 0; i < count; i++) {
+			if (i_rand_limit(100) < clients[i]->percentage)
+				mask |= 1U << i;
+		}
+	}
+	return mask;
+}
+
+static void
+user_init_client_profiles(struct user *user, uint32_t client_mask)
+{
+	struct profile_client *const *clients;
+	unsigned int i, count;
+
+	clients = array_get(&users_profile->clients, &count);
+	for (i = 0; i < count; i++) {
+		if ((client_mask & (1U << i)) != 0)
+			user_add_client_profile(user, clients[i]);
+	}
+}
+
+static void
+get_username(const struct profile_user *user_profile,
+	     string_t *username, unsigned int i)
+{
+	char num[10];
+	const struct var_expand_params params = {
+		.table = (const struct var_expand_table[]) {
+			{ .key = "username_idx", .value = num, },
+			VAR_EXPAND_TABLE_END
+		},
+		.providers = NULL,
+	};
+	const char *error;
+
+	str_truncate(username, 0);
+	i_snprintf(num, sizeof(num), "%u",
+		   user_profile->username_start_index + i-1);
+	if (var_expand(username, user_profile->username_format,
+		       &params, &error) < 0)
+		i_error("var_expand(%s) failed: %s",
+			user_profile->username_format, error);
+}
+
+static unsigned int
+user_slot_queue_item_idx(const struct priorityq_item *item)
+{
+	return item - slots.queue_items;
+}
+
+static void
+user_slot_fill_timestamps(unsigned int slot,
+			  const struct profile_user *user_profile,
+			  int64_t start_time)
 {
 	enum user_timestamp ts;
 	unsigned int interval;
+	int64_t timestamp;
 
 	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++) {
-		interval = user_get_timeout_interval(user, ts);
-		user->timestamps[ts] = interval == 0 ? (time_t)-1 :
-			(time_t)(start_time + i_rand_limit(interval));
-		user_set_min_timestamp(user, user->timestamps[ts]);
+		interval = user_get_timeout_interval(user_profile, ts);
+		timestamp = interval == 0 ? -1 :
+			start_time + i_rand_limit(interval * 1000);
+		slots.timestamps[ts][slot] = timestamp;
+		user_slot_set_min_timestamp(slot, timestamp);
+	}
+	slots.timestamps[USER_TIMESTAMP_LOGIN][slot] = start_time;
+	user_slot_set_min_timestamp(slot, start_time);
+}
+
+static const struct user_slot_range *user_slot_get_range(unsigned int slot)
+{
+	const struct user_slot_range *range;
+
+	array_foreach(&slot_ranges, range) {
+		if (slot < range->first_slot + range->count)
+			return range;
 	}
-	user->timestamps[USER_TIMESTAMP_LOGIN] = start_time;
-	user_set_min_timestamp(user, start_time);
+	i_unreached();
+}
+
+static unsigned int
+user_slot_get_username_idx(const struct user_slot_range *range,
+			   unsigned int slot)
+{
+	unsigned int n = slot - range->first_slot;
+
+	/* reverse the worker split of users_add_from_user_profile() */
+	if (conf.workers_count > 1)
+		n = n * conf.workers_count + conf.worker_idx;
+	return n + 1;
+}
+
+static bool user_client_has_state(const struct user_client *uc)
+{
+	return array_count(&uc->mailboxes) > 0 ||
+		uc->pop3_uidls_pool != NULL || uc->draft_uid != 0;
+}
+
+static void user_slot_save_state(struct user *user)
+{
+	struct user_slot_state *state = NULL;
+	struct user_slot_client_state *cs;
+	struct user_client *const *ucs;
+	struct user_mailbox_cache *const *caches, *saved;
+	unsigned int i, j, count, caches_count;
+	pool_t pool;
+
+	ucs = array_get(&user->clients, &count);
+	for (i = 0; i < count; i++) {
+		if (!user_client_has_state(ucs[i]))
+			continue;
+		if (state == NULL) {
+			pool = pool_alloconly_create("user slot state", 256);
+			state = p_new(pool, struct user_slot_state, 1);
+			state->pool = pool;
+			state->clients = p_new(pool,
+				struct user_slot_client_state, count);
+			state->clients_count = count;
+		}
+		cs = &state->clients[i];
+
+		caches = array_get(&ucs[i]->mailboxes, &caches_count);
+		if (caches_count > 0) {
+			p_array_init(&cs->mailboxes, state->pool,
+				     caches_count);
+		}
+		for (j = 0; j < caches_count; j++) {
+			saved = array_append_space(&cs->mailboxes);
+			*saved = *caches[j];
+			saved->mailbox_name = p_strdup(state->pool,
+						       caches[j]->mailbox_name);
+		}
+		/* the UIDLs are allocated from their own pool, which moves
+		   to the state */
+		cs->pop3_uidls_pool = ucs[i]->pop3_uidls_pool;
+		cs->pop3_uidls = ucs[i]->pop3_uidls;
+		ucs[i]->pop3_uidls_pool = NULL;
+		cs->draft_uid = ucs[i]->draft_uid;
+	}
+	if (state != NULL) {
+		hash_table_insert(slot_states,
+				  POINTER_CAST(user->profile_slot + 1), state);
+	}
+}
+
+static void user_slot_restore_state(struct user *user)
+{
+	void *key = POINTER_CAST(user->profile_slot + 1);
+	struct user_slot_state *state;
+	struct user_slot_client_state *cs;
+	struct user_client *const *ucs;
+	const struct user_mailbox_cache *saved;
+	struct user_mailbox_cache *cache;
+	const char *name;
+	unsigned int i, count;
+
+	state = hash_table_lookup(slot_states, key);
+	if (state == NULL)
+		return;
+	hash_table_remove(slot_states, key);
+
+	ucs = array_get(&user->clients, &count);
+	i_assert(count == state->clients_count);
+	for (i = 0; i < count; i++) {
+		cs = &state->clients[i];
+		if (array_is_created(&cs->mailboxes)) {
+			array_foreach(&cs->mailboxes, saved) {
+				cache = user_get_mailbox_cache(ucs[i],
+					saved->mailbox_name);
+				name = cache->mailbox_name;
+				*cache = *saved;
+				cache->mailbox_name = name;
+			}
+		}
+		ucs[i]->pop3_uidls_pool = cs->pop3_uidls_pool;
+		ucs[i]->pop3_uidls = cs->pop3_uidls;
+		ucs[i]->draft_uid = cs->draft_uid;
+	}
+	pool_unref(&state->pool);
+}
+
+static void user_slot_state_free(struct user_slot_state *state)
+{
+	unsigned int i;
+
+	for (i = 0; i < state->clients_count; i++) {
+		if (state->clients[i].pop3_uidls_pool != NULL)
+			pool_unref(&state->clients[i].pop3_uidls_pool);
+	}
+	pool_unref(&state->pool);
+}
+
+static struct user *user_slot_get_user(unsigned int slot)
+{
+	const struct user_slot_range *range;
+	const char *username, *password;
+	struct user *user;
+	enum user_timestamp ts;
+	unsigned int idx;
+
+	user = hash_table_lookup(slot_users, POINTER_CAST(slot + 1));
+	if (user != NULL)
+		return user;
+
+	range = user_slot_get_range(slot);
+	idx = user_slot_get_username_idx(range, slot);
+	if (range->userfile != NULL) {
+		userfile_get(range->userfile, idx - 1, &username, &password);
+		user = user_new(username, users_source);
+		if (password != NULL && *password != '\0')
+			user->password = password;
+	} else T_BEGIN {
+		string_t *str = t_str_new(64);
+
+		get_username(range->user_profile, str, idx);
+		user = user_new(str_c(str), users_source);
+	} T_END;
+
+	user->profile = range->user_profile;
+	user->profile_slot = slot;
+	user_init_client_profiles(user, slots.client_masks[slot]);
+	user_slot_restore_state(user);
+	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++)
+		user->timestamps[ts] = slots.timestamps[ts][slot];
+	hash_table_insert(slot_users, POINTER_CAST(slot + 1), user);
+	return user;
+}
+
+static bool user_slot_can_free_user(struct user *user)
+{
+	struct user_client *uc;
+
+	array_foreach_elem(&user->clients, uc) {
+		if (array_count(&uc->clients) > 0 || uc->draft_cmd != NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void user_slot_free_user(struct user *user)
+{
+	unsigned int slot = user->profile_slot;
+	enum user_timestamp ts;
+
+	if (user->timestamps[USER_TIMESTAMP_LOGIN] == -1) {
+		/* the clients' last_logout timestamps are forgotten, so
+		   remember when the user can log in next */
+		user->timestamps[USER_TIMESTAMP_LOGIN] =
+			user_get_next_login_time(user);
+		user_set_min_timestamp(user,
+			user->timestamps[USER_TIMESTAMP_LOGIN]);
+	}
+	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++)
+		slots.timestamps[ts][slot] = user->timestamps[ts];
+	user_slot_save_state(user);
+	hash_table_remove(slot_users, POINTER_CAST(slot + 1));
+	user_free(&user);
+}
+
+static int users_queue_cmp(const void *p1, const void *p2)
+{
+	int64_t ts1 = slots.next_min_timestamp[user_slot_queue_item_idx(p1)];
+	int64_t ts2 = slots.next_min_timestamp[user_slot_queue_item_idx(p2)];
+
+	if (ts1 < ts2)
+		return -1;
+	return ts1 > ts2 ? 1 : 0;
 }
 
 static void users_timeout(void *context ATTR_UNUSED)
 {
-	const ARRAY_TYPE(user) *users = users_get_sort_by_min_timestamp();
+	ARRAY(unsigned int) due_slots;
+	struct hash_iterate_context *iter;
 	struct user *user;
+	void *key;
+	unsigned int slot;
+	int64_t now;
 
 	timeout_remove(&to_users);
-	array_foreach_elem(users, user) {
-		if (ioloop_time < user->next_min_timestamp &&
-		    !disconnect_clients) {
+	if (disconnect_clients) {
+		iter = hash_table_iterate_init(slot_users);
+		while (hash_table_iterate(iter, slot_users, &key, &user))
+			user_run_actions(user);
+		hash_table_iterate_deinit(&iter);
+		users_timeout_update();
+		return;
+	}
+
+	/* remove the users whose event is due first, since running the
+	   actions adds them back to the queue, possibly as due again */
+	now = users_get_ioloop_msecs();
+	t_array_init(&due_slots, 64);
+	while (priorityq_count(users_queue) > 0) {
+		slot = user_slot_queue_item_idx(priorityq_peek(users_queue));
+		if (now < slots.next_min_timestamp[slot]) {
 			/* wait for the next user's event */
 			break;
 		}
+		(void)priorityq_pop(users_queue);
+		slots.next_min_timestamp[slot] = USER_SLOT_NOT_QUEUED;
+		array_append(&due_slots, &slot, 1);
+	}
+	array_foreach_elem(&due_slots, slot) {
+		user = user_slot_get_user(slot);
 		user_run_actions(user);
+		if (user_slot_can_free_user(user))
+			user_slot_free_user(user);
 	}
 	/* make sure a timeout is always set */
 	if (to_users == NULL)
@@ -560,159 +934,242 @@ static void users_timeout(void *context ATTR_UNUSED)
 
 static void users_timeout_update(void)
 {
+	unsigned int slot;
+	int64_t now = users_get_ioloop_msecs();
+	int64_t min_timestamp = INT64_MAX;
+
+	if (priorityq_count(users_queue) > 0) {
+		slot = user_slot_queue_item_idx(priorityq_peek(users_queue));
+		min_timestamp = slots.next_min_timestamp[slot];
+	}
+
 	if (to_users != NULL)
 		timeout_remove(&to_users);
-	if (users_min_timestamp <= ioloop_time)
-		to_users = timeout_add_short(500, users_timeout, (void *)NULL);
-	else {
-		to_users = timeout_add((users_min_timestamp - ioloop_time) * 1000,
-				       users_timeout, (void *)NULL);
+	if (min_timestamp <= now) {
+		to_users = timeout_add_short(USER_EVENT_DUE_DELAY_MSECS,
+					     users_timeout, (void *)NULL);
+		to_users_timestamp = now;
+	} else if (min_timestamp != INT64_MAX) {
+		to_users = timeout_add_short(min_timestamp - now,
+					     users_timeout, (void *)NULL);
+		to_users_timestamp = min_timestamp;
+	} else {
+		/* no users have any events. check again every once in a
+		   while in case something changes without updating
+		   the queue. */
+		to_users = timeout_add(60 * 1000, users_timeout, (void *)NULL);
+		to_users_timestamp = now + 60 * 1000;
 	}
 }
 
-static void user_set_min_timestamp(struct user *user, time_t min_timestamp)
+static void
+user_slot_set_min_timestamp(unsigned int slot, int64_t min_timestamp)
 {
+	int64_t now = users_get_ioloop_msecs();
+
 	if (min_timestamp <= 0)
 		return;
-	if (min_timestamp <= ioloop_time) {
-		/* always set timestamps to future so we don't run the timeout
-		   multiple times within second (which is bad if users are
-		   sorted multiple times a second) */
-		min_timestamp = ioloop_time;
-	}
-	if (user->next_min_timestamp > min_timestamp)
-		user->next_min_timestamp = min_timestamp;
-	if (users_min_timestamp > min_timestamp) {
-		users_min_timestamp = min_timestamp;
-		users_timeout_update();
+	if (min_timestamp <= now) {
+		/* already due. users_timeout_update() delays these a bit,
+		   so the user's events don't run in a busy loop. */
+		min_timestamp = now;
 	}
+	if (slots.next_min_timestamp[slot] <= min_timestamp)
+		return;
+
+	if (slots.next_min_timestamp[slot] != USER_SLOT_NOT_QUEUED)
+		priorityq_remove(users_queue, &slots.queue_items[slot]);
+	slots.next_min_timestamp[slot] = min_timestamp;
+	priorityq_add(users_queue, &slots.queue_items[slot]);
+
+	/* update the timeout only if it needs to trigger earlier */
+	if (to_users == NULL || min_timestamp < to_users_timestamp)
+		users_timeout_update();
 }
 
-static void
-user_add_client_profile(struct user *user, struct profile_client *profile)
+static void user_set_min_timestamp(struct user *user, int64_t min_timestamp)
 {
-	struct user_client *uc;
+	user_slot_set_min_timestamp(user->profile_slot, min_timestamp);
+}
 
-	uc = p_new(user->pool, struct user_client, 1);
-	uc->user = user;
-	uc->profile = profile;
-	p_array_init(&uc->clients, user->pool, 4);
-	p_array_init(&uc->mailboxes, user->pool, 2);
-	array_append(&user->clients, &uc, 1);
+static unsigned int
+profile_user_get_worker_count(const struct profile_user *user_profile)
+{
+	if (conf.workers_count <= 1)
+		return user_profile->user_count;
+	if (user_profile->user_count <= conf.worker_idx)
+		return 0;
+	return (user_profile->user_count - conf.worker_idx - 1) /
+		conf.workers_count + 1;
 }
 
 static void
-user_init_client_profiles(struct user *user, struct profile *profile)
+users_add_from_user_profile(const struct profile_user *user_profile,
+			    struct profile *profile, unsigned int *next_slot)
 {
-	struct profile_client *client;
+	struct user_slot_range *range;
+	unsigned int i, slot;
+	int64_t start_time;
+
+	range = array_append_space(&slot_ranges);
+	range->user_profile = user_profile;
+	range->first_slot = *next_slot;
+	range->count = profile_user_get_worker_count(user_profile);
+	*next_slot += range->count;
+
+	if (user_profile->userfile != NULL) {
+		/* the users are looked up by their line index */
+		range->userfile = userfile_load(user_profile->userfile);
+		if (userfile_get_count(range->userfile) <
+		    user_profile->user_count) {
+			i_fatal("userfile %s ends too early - must have at "
+				"least user_count=%u users",
+				user_profile->userfile,
+				user_profile->user_count);
+		}
+	}
+
+	slot = range->first_slot;
+	for (i = 1; i <= user_profile->user_count; i++) {
+		/* spread the logins evenly over the rampup time, with
+		   millisecond precision */
+		start_time = users_get_ioloop_msecs() +
+			(int64_t)profile->rampup_time * 1000 *
+			i / user_profile->user_count;
 
-	p_array_init(&user->clients, user->pool,
-		     array_count(&profile->clients));
-	while (array_count(&user->clients) == 0) {
-		array_foreach_elem(&profile->clients, client) {
-			if (i_rand_limit(100) < client->percentage)
-				user_add_client_profile(user, client);
+		if (conf.workers_count > 1 &&
+		    (i - 1) % conf.workers_count != conf.worker_idx) {
+			/* user belongs to another worker process */
+			continue;
 		}
+
+		slots.next_min_timestamp[slot] = USER_SLOT_NOT_QUEUED;
+		slots.client_masks[slot] = user_get_random_client_mask(profile);
+		user_slot_fill_timestamps(slot, user_profile, start_time);
+		slot++;
 	}
+	i_assert(slot == range->first_slot + range->count);
 }
 
-static void
-get_next_username(const struct profile_user *user_profile,
-		  struct istream *users_input,
-		  string_t *username, string_t *password, unsigned int i)
+void profile_add_users(struct profile *profile,
+		       struct mailbox_source *source)
 {
-	char num[10];
-	const struct var_expand_params params = {
-		.table = (const struct var_expand_table[]) {
-			{ .key = "username_idx", .value = num, },
-			VAR_EXPAND_TABLE_END
-		},
-		.providers = NULL,
-	};
-	const char *line, *error;
+	struct profile_user *user_profile;
+	struct profile_client *const *clients;
+	enum user_timestamp ts;
+	unsigned int i, count, slot = 0;
 
-	str_truncate(username, 0);
-	str_truncate(password, 0);
-
-	if (users_input == NULL) {
-		i_snprintf(num, sizeof(num), "%u",
-			   user_profile->username_start_index + i-1);
-		if (var_expand(username, user_profile->username_format,
-			       &params, &error) < 0)
-			i_error("var_expand(%s) failed: %s",
-				user_profile->username_format, error);
-		return;
+	clients = array_get(&profile->clients, &count);
+	if (count > USER_SLOT_MAX_CLIENTS) {
+		i_fatal("profile: Too many client definitions (max %u)",
+			USER_SLOT_MAX_CLIENTS);
 	}
-
-	while ((line = i_stream_read_next_line(users_input)) != NULL) {
-		if (*line != '\0' && *line != ':') {
-			const char *p = strchr(line, ':');
-			if (p == NULL)
-				str_append(username, line);
-			else {
-				str_append_data(username, line, p-line);
-				str_append(password, p+1);
-			}
-			return;
-		}
+	for (i = 0; i < count; i++) {
+		if (clients[i]->connection_max_count > 0)
+			slot_connectable_clients_mask |= 1U << i;
 	}
 
-	if (users_input->stream_errno != 0)
-		i_fatal("Failed to read userfile %s: failed: %s",
-			user_profile->userfile, i_stream_get_error(users_input));
-	i_fatal("userfile %s ends too early - must have at least user_count=%u users",
-		user_profile->userfile, user_profile->user_count);
+	users_profile = profile;
+	users_source = source;
+	array_foreach_elem(&profile->users, user_profile)
+		slots.count += profile_user_get_worker_count(user_profile);
+	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++)
+		slots.timestamps[ts] = i_new(int64_t, slots.count);
+	slots.next_min_timestamp = i_new(int64_t, slots.count);
+	slots.client_masks = i_new(uint32_t, slots.count);
+	slots.queue_items = i_new(struct priorityq_item, slots.count);
+
+	users_queue = priorityq_init(users_queue_cmp, 128);
+	hash_table_create_direct(&slot_users, default_pool, 0);
+	hash_table_create_direct(&slot_states, default_pool, 0);
+	i_array_init(&slot_ranges, array_count(&profile->users));
+	array_foreach_elem(&profile->users, user_profile)
+		users_add_from_user_profile(user_profile, profile, &slot);
+	i_assert(slot == slots.count);
 }
 
-static void
-users_add_from_user_profile(const struct profile_user *user_profile,
-			    struct profile *profile, ARRAY_TYPE(user) *users,
-			    struct mailbox_source *source)
+bool profile_get_random_user(struct user **user_r)
 {
 	struct user *user;
-	struct istream *users_input;
-	string_t *username = t_str_new(64);
-	string_t *password = t_str_new(64);
-	unsigned int i;
-	time_t start_time;
-
-	if (user_profile->userfile == NULL)
-		users_input = NULL;
-	else {
-		users_input = i_stream_create_file(user_profile->userfile, (size_t)-1);
-		i_stream_set_return_partial_line(users_input, TRUE);
-	}
+	unsigned int i, slot, start_idx;
+	int64_t login_time, now = users_get_ioloop_msecs();
 
-	for (i = 1; i <= user_profile->user_count; i++) {
-		start_time = ioloop_time + profile->rampup_time *
-			i / user_profile->user_count;
+	if (slots.count == 0)
+		return FALSE;
 
-		get_next_username(user_profile, users_input,
-				  username, password, i);
+	start_idx = i_rand_limit(slots.count);
+	for (i = 0; i < slots.count; i++) {
+		slot = (i + start_idx) % slots.count;
+		user = hash_table_lookup(slot_users, POINTER_CAST(slot + 1));
+		if (user != NULL) {
+			if (!user_can_connect_clients(user))
+				continue;
+			*user_r = user;
+			return TRUE;
+		}
 
-		user = user_get(str_c(username), source);
-		if (str_len(password) > 0)
-			user->password = p_strdup(user->pool, str_c(password));
-		user->profile = user_profile;
-		user_init_client_profiles(user, profile);
-		user_fill_timestamps(user, start_time);
-		array_append(users, &user, 1);
+		/* unallocated users have no connections and their clients'
+		   logouts are forgotten, so they can connect once the login
+		   time has come. allocate only the user that is picked. */
+		login_time = slots.timestamps[USER_TIMESTAMP_LOGIN][slot];
+		if (login_time == -1 || login_time > now ||
+		    (slots.client_masks[slot] &
+		     slot_connectable_clients_mask) == 0)
+			continue;
+		user = user_slot_get_user(slot);
+		i_assert(user_can_connect_clients(user));
+		*user_r = user;
+		return TRUE;
 	}
-	i_stream_unref(&users_input);
+	return FALSE;
 }
 
-void profile_add_users(struct profile *profile, ARRAY_TYPE(user) *users,
-		       struct mailbox_source *source)
+void profile_user_disconnected(struct user *user)
 {
-	struct profile_user *user;
-
-	i_array_init(users, 128);
-	array_foreach_elem(&profile->users, user)
-		users_add_from_user_profile(user, profile, users, source);
+	if (users_queue == NULL)
+		return;
+	/* run the user's events soon, which also frees the user unless it
+	   connects again */
+	user_set_min_timestamp(user, users_get_ioloop_msecs());
 }
 
 void profile_deinit(void)
 {
+	struct user_slot_range *range;
+	struct hash_iterate_context *iter;
+	struct user *user;
+	struct user_slot_state *state;
+	enum user_timestamp ts;
+	void *key;
+
 	if (to_users != NULL)
 		timeout_remove(&to_users);
+	if (users_queue != NULL)
+		priorityq_deinit(&users_queue);
+	if (hash_table_is_created(slot_users)) {
+		iter = hash_table_iterate_init(slot_users);
+		while (hash_table_iterate(iter, slot_users, &key, &user))
+			user_free(&user);
+		hash_table_iterate_deinit(&iter);
+		hash_table_destroy(&slot_users);
+	}
+	if (hash_table_is_created(slot_states)) {
+		iter = hash_table_iterate_init(slot_states);
+		while (hash_table_iterate(iter, slot_states, &key, &state))
+			user_slot_state_free(state);
+		hash_table_iterate_deinit(&iter);
+		hash_table_destroy(&slot_states);
+	}
+	for (ts = 0; ts < USER_TIMESTAMP_COUNT; ts++)
+		i_free(slots.timestamps[ts]);
+	i_free(slots.next_min_timestamp);
+	i_free(slots.client_masks);
+	i_free(slots.queue_items);
+	if (array_is_created(&slot_ranges)) {
+		array_foreach_modifiable(&slot_ranges, range) {
+			if (range->userfile != NULL)
+				userfile_free(&range->userfile);
+		}
+		array_free(&slot_ranges);
+	}
 }
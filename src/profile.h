@@ -84,8 +84,14 @@ int imap_client_profile_send_more_commands(struct client *client);
 int imap_client_profile_handle_untagged(struct imap_client *client,
 					const struct imap_arg *args);
 
-void profile_add_users(struct profile *profile, ARRAY_TYPE(user) *users,
+/* Add the profile's users in a compact form. A struct user is allocated
+   only while the user is connected or running its events. */
+void profile_add_users(struct profile *profile,
 		       struct mailbox_source *source);
+/* Find a random profile user that can connect now. */
+bool profile_get_random_user(struct user **user_r);
+/* The user's last connection was removed. */
+void profile_user_disconnected(struct user *user);
 
 void profile_deinit(void);
 
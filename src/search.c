@@ -7,6 +7,7 @@
 #include "utc-mktime.h"
 #include "imap-date.h"
 #include "imap-arg.h"
+#include "settings.h"
 #include "commands.h"
 #include "mailbox.h"
 #include "imap-client.h"
@@ -247,6 +248,8 @@ static void search_callback(struct imap_client *client, struct command *cmd,
 
 	if (reply != REPLY_OK)
 		imap_client_input_warn(client, "SEARCH failed");
+	else if (conf.benchmark)
+		counters[cmd->state]++;
 	else if (!array_is_created(&client->search_ctx->result))
 		imap_client_input_warn(client, "Missing untagged SEARCH");
 	else {
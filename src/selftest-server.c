@@ -0,0 +1,390 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "llist.h"
+#include "str.h"
+#include "net.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "settings.h"
+#include "client-state.h"
+#include "workers.h"
+#include "selftest-server.h"
+
+#include <stdio.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#define SELFTEST_MAX_LINE_LENGTH 8192
+#define SELFTEST_CAPABILITY "IMAP4rev1 LITERAL+ IDLE"
+
+struct selftest_conn {
+	struct selftest_conn *prev, *next;
+
+	int fd;
+	struct io *io;
+	struct istream *input;
+	struct ostream *output;
+
+	/* tag of the command waiting for DONE (IDLE), the SASL response
+	   (AUTHENTICATE) or the rest of its line after a literal */
+	char *tag, *cmd;
+	uoff_t literal_left;
+	bool idling:1;
+	bool authenticating:1;
+	bool logout:1;
+};
+
+static struct selftest_conn *conns = NULL;
+static struct io *listen_io, *parent_io;
+static pid_t server_pid = 0;
+/* the server stops when the parent closes this pipe */
+static int parent_fd = -1;
+
+static uint64_t start_usecs;
+static struct rusage start_rusage;
+
+static void selftest_conn_destroy(struct selftest_conn *conn)
+{
+	DLLIST_REMOVE(&conns, conn);
+	io_remove(&conn->io);
+	i_stream_destroy(&conn->input);
+	o_stream_destroy(&conn->output);
+	i_close_fd(&conn->fd);
+	i_free(conn->tag);
+	i_free(conn->cmd);
+	i_free(conn);
+}
+
+static void
+selftest_conn_reply(struct selftest_conn *conn, const char *tag,
+		    const char *cmd)
+{
+	string_t *str = t_str_new(256);
+
+	if (strcasecmp(cmd, "CAPABILITY") == 0)
+		str_append(str, "* CAPABILITY "SELFTEST_CAPABILITY"\r\n");
+	else if (strcasecmp(cmd, "SELECT") == 0 ||
+		 strcasecmp(cmd, "EXAMINE") == 0) {
+		/* claim the mailbox is already full, so the clients don't
+		   keep appending to reach the msgs threshold */
+		str_printfa(str, "* FLAGS (\\Answered \\Flagged \\Deleted "
+			    "\\Seen \\Draft)\r\n"
+			    "* %u EXISTS\r\n* 0 RECENT\r\n"
+			    "* OK [UIDVALIDITY 1] UIDs valid\r\n"
+			    "* OK [UIDNEXT %u] Predicted next UID\r\n",
+			    conf.message_count_threshold,
+			    conf.message_count_threshold + 1);
+	} else if (strcasecmp(cmd, "FETCH") == 0) {
+		str_append(str, "* 1 FETCH (UID 1 FLAGS (\\Seen))\r\n");
+	} else if (strcasecmp(cmd, "IDLE") == 0) {
+		o_stream_nsend_str(conn->output, "+ idling\r\n");
+		conn->idling = TRUE;
+		return;
+	} else if (strcasecmp(cmd, "LOGOUT") == 0) {
+		str_append(str, "* BYE Logging out\r\n");
+		conn->logout = TRUE;
+	}
+
+	str_printfa(str, "%s OK Completed.\r\n", tag);
+	o_stream_nsend(conn->output, str_data(str), str_len(str));
+}
+
+static bool
+selftest_line_get_literal(const char *line, uoff_t *size_r, bool *sync_r)
+{
+	size_t len = strlen(line);
+	const char *p;
+
+	if (len < 3 || line[len-1] != '}')
+		return FALSE;
+	len--;
+	*sync_r = line[len-1] != '+';
+	if (!*sync_r)
+		len--;
+	p = line + len;
+	while (p > line && p[-1] >= '0' && p[-1] <= '9')
+		p--;
+	if (p == line || p[-1] != '{' ||
+	    str_to_uoff(t_strndup(p, line + len - p), size_r) < 0)
+		return FALSE;
+	return TRUE;
+}
+
+static void selftest_conn_line(struct selftest_conn *conn, const char *line)
+{
+	const char *const *args;
+	uoff_t literal_size;
+	bool sync;
+
+	if (conn->idling) {
+		if (strcasecmp(line, "DONE") == 0) {
+			selftest_conn_reply(conn, conn->tag, "DONE");
+			i_free(conn->tag);
+			conn->idling = FALSE;
+		}
+		return;
+	}
+	if (conn->authenticating) {
+		/* accept any SASL response */
+		selftest_conn_reply(conn, conn->tag, "AUTHENTICATE");
+		i_free(conn->tag);
+		conn->authenticating = FALSE;
+		return;
+	}
+
+	if (conn->tag == NULL) {
+		/* a new command: <tag> <command> [args] */
+		args = t_strsplit_spaces(line, " ");
+		if (args[0] == NULL)
+			return;
+		if (args[1] == NULL) {
+			o_stream_nsend_str(conn->output, t_strdup_printf(
+				"%s BAD Missing command.\r\n", args[0]));
+			return;
+		}
+		if (strcasecmp(args[1], "AUTHENTICATE") == 0 &&
+		    str_array_length(args) == 3) {
+			o_stream_nsend_str(conn->output, "+ \r\n");
+			conn->tag = i_strdup(args[0]);
+			conn->authenticating = TRUE;
+			return;
+		}
+		conn->tag = i_strdup(args[0]);
+		conn->cmd = i_strdup(args[1]);
+	}
+
+	if (selftest_line_get_literal(line, &literal_size, &sync)) {
+		/* the command continues after the literal */
+		conn->literal_left = literal_size;
+		if (sync)
+			o_stream_nsend_str(conn->output, "+ OK\r\n");
+		return;
+	}
+
+	selftest_conn_reply(conn, conn->tag, conn->cmd);
+	if (!conn->idling)
+		i_free(conn->tag);
+	i_free(conn->cmd);
+}
+
+static bool selftest_conn_input_next(struct selftest_conn *conn)
+{
+	const char *line;
+	size_t size;
+
+	if (conn->literal_left > 0) {
+		(void)i_stream_get_data(conn->input, &size);
+		if (size == 0)
+			return FALSE;
+		if (size > conn->literal_left)
+			size = conn->literal_left;
+		i_stream_skip(conn->input, size);
+		conn->literal_left -= size;
+		return TRUE;
+	}
+
+	line = i_stream_next_line(conn->input);
+	if (line == NULL)
+		return FALSE;
+	T_BEGIN {
+		selftest_conn_line(conn, line);
+	} T_END;
+	return TRUE;
+}
+
+static void selftest_conn_input(struct selftest_conn *conn)
+{
+	ssize_t ret;
+
+	ret = i_stream_read(conn->input);
+	if (ret == -2) {
+		i_error("Client sent a too long line");
+		selftest_conn_destroy(conn);
+		return;
+	}
+
+	o_stream_cork(conn->output);
+	while (selftest_conn_input_next(conn)) ;
+	o_stream_uncork(conn->output);
+
+	if (ret < 0 || conn->logout) {
+		(void)o_stream_flush(conn->output);
+		selftest_conn_destroy(conn);
+	}
+}
+
+static void selftest_listen_accept(void *context)
+{
+	int *listen_fd = context;
+	struct selftest_conn *conn;
+	int fd;
+
+	fd = net_accept(*listen_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd < 0) {
+		i_error("accept() failed: %m");
+		return;
+	}
+	net_set_nonblock(fd, TRUE);
+
+	conn = i_new(struct selftest_conn, 1);
+	conn->fd = fd;
+	conn->input = i_stream_create_fd(fd, SELFTEST_MAX_LINE_LENGTH);
+	conn->output = o_stream_create_fd(fd, (size_t)-1);
+	o_stream_set_no_error_handling(conn->output, TRUE);
+	conn->io = io_add(fd, IO_READ, selftest_conn_input, conn);
+	DLLIST_PREPEND(&conns, conn);
+
+	o_stream_nsend_str(conn->output, "* OK [CAPABILITY "
+			   SELFTEST_CAPABILITY"] imaptest selftest ready.\r\n");
+}
+
+static void selftest_parent_input(void *context ATTR_UNUSED)
+{
+	/* the parent closed the pipe or died */
+	io_loop_stop(current_ioloop);
+}
+
+static void ATTR_NORETURN selftest_server_run(int listen_fd, int pipe_fd)
+{
+	struct ioloop *ioloop;
+
+	i_set_failure_prefix("selftest server: ");
+	/* Ctrl-C reaches the whole process group. the server stops only
+	   after the parent has finished and closed the pipe. */
+	(void)signal(SIGINT, SIG_IGN);
+	(void)signal(SIGTERM, SIG_IGN);
+	/* clients may disconnect before reading all the replies */
+	(void)signal(SIGPIPE, SIG_IGN);
+	ioloop = io_loop_create();
+	listen_io = io_add(listen_fd, IO_READ, selftest_listen_accept,
+			   &listen_fd);
+	parent_io = io_add(pipe_fd, IO_READ, selftest_parent_input, NULL);
+	io_loop_run(ioloop);
+
+	while (conns != NULL)
+		selftest_conn_destroy(conns);
+	io_remove(&parent_io);
+	io_remove(&listen_io);
+	i_close_fd(&listen_fd);
+	i_close_fd(&pipe_fd);
+	io_loop_destroy(&ioloop);
+	lib_exit(0);
+}
+
+void selftest_server_fork(void)
+{
+	struct ip_addr ip;
+	in_port_t port = 0;
+	int listen_fd, fd[2];
+
+	if (net_addr2ip("127.0.0.1", &ip) < 0)
+		i_unreached();
+	listen_fd = net_listen(&ip, &port, 128);
+	if (listen_fd == -1)
+		i_fatal("selftest_server: listen(127.0.0.1) failed: %m");
+	if (pipe(fd) < 0)
+		i_fatal("pipe() failed: %m");
+
+	fflush(stdout);
+	server_pid = fork();
+	if (server_pid < 0)
+		i_fatal("fork() failed: %m");
+	if (server_pid == 0) {
+		i_close_fd(&fd[1]);
+		selftest_server_run(listen_fd, fd[0]);
+	}
+	i_close_fd(&listen_fd);
+	i_close_fd(&fd[0]);
+	parent_fd = fd[1];
+
+	conf.host = "127.0.0.1";
+	conf.port = port;
+	/* the canned responses don't keep any mailbox state */
+	conf.no_tracking = TRUE;
+}
+
+void selftest_server_init(void)
+{
+	if (server_pid == 0 || workers_is_worker())
+		return;
+
+	start_usecs = client_state_get_timer_usecs();
+	if (getrusage(RUSAGE_SELF, &start_rusage) < 0)
+		i_fatal("getrusage() failed: %m");
+}
+
+static uint64_t timeval_usecs(const struct timeval *tv)
+{
+	return (uint64_t)tv->tv_sec * 1000000 + tv->tv_usec;
+}
+
+static void selftest_server_print(void)
+{
+	struct rusage self, children;
+	uint64_t secs_usecs, cpu_usecs, commands = 0;
+	unsigned int i, conns_per_process;
+	long rss_kb;
+
+	secs_usecs = client_state_get_timer_usecs() - start_usecs;
+	for (i = 1; i < STATE_COUNT; i++)
+		commands += total_counters[i];
+	/* the workers have been reaped, but the server hasn't yet, so the
+	   children's usage is only the workers' */
+	if (getrusage(RUSAGE_SELF, &self) < 0 ||
+	    getrusage(RUSAGE_CHILDREN, &children) < 0)
+		i_fatal("getrusage() failed: %m");
+	cpu_usecs = timeval_usecs(&self.ru_utime) +
+		timeval_usecs(&self.ru_stime) +
+		timeval_usecs(&children.ru_utime) +
+		timeval_usecs(&children.ru_stime) -
+		timeval_usecs(&start_rusage.ru_utime) -
+		timeval_usecs(&start_rusage.ru_stime);
+
+	/* the peak RSS growth of the process running the clients, so that
+	   the memory used before they were created isn't counted. the
+	   workers were forked right before the start, so they began with
+	   about the parent's RSS. */
+	if (workers_is_parent()) {
+		/* the largest worker */
+		rss_kb = children.ru_maxrss - start_rusage.ru_maxrss;
+		conns_per_process = conf.clients_count / conf.workers_count;
+	} else {
+		rss_kb = self.ru_maxrss - start_rusage.ru_maxrss;
+		conns_per_process = conf.clients_count;
+	}
+	if (rss_kb < 0)
+		rss_kb = 0;
+
+	printf("\nSelf-benchmark (imaptest only, excluding the server):\n");
+	printf("%-20s %12.1f\n", "commands/sec", secs_usecs == 0 ? 0 :
+	       commands * 1000000.0 / secs_usecs);
+	printf("%-20s %12.1f\n", "CPU usecs/command", commands == 0 ? 0 :
+	       cpu_usecs / (double)commands);
+	printf("%-20s %12.1f\n", "KB/connection", conns_per_process == 0 ? 0 :
+	       rss_kb / (double)conns_per_process);
+}
+
+void selftest_server_deinit(void)
+{
+	int status;
+
+	if (server_pid == 0 || workers_is_worker())
+		return;
+
+	selftest_server_print();
+	i_close_fd(&parent_fd);
+	if (waitpid(server_pid, &status, 0) < 0)
+		i_error("waitpid(%s) failed: %m", dec2str(server_pid));
+	else if (WIFSIGNALED(status)) {
+		i_error("selftest server killed with signal %d",
+			WTERMSIG(status));
+	}
+	server_pid = 0;
+}
@@ -0,0 +1,15 @@
+#ifndef SELFTEST_SERVER_H
+#define SELFTEST_SERVER_H
+
+/* Fork a minimal IMAP server on 127.0.0.1 that answers every command with
+   a canned response and point conf.host/port at it, so imaptest's own
+   overhead can be measured. Must be called before the ioloop is created
+   and before the workers are forked. */
+void selftest_server_fork(void);
+/* Start measuring. Must be called before the clients are created. */
+void selftest_server_init(void);
+/* Stop the server and print the self-benchmark results. Must be called
+   after the workers have finished. */
+void selftest_server_deinit(void);
+
+#endif
@@ -32,9 +32,23 @@
 //#define RAND_KEYWORDS 40
 
 #define DELAY_MSECS 1000
+/* Default number of commands a client pipelines */
 #define MAX_COMMAND_QUEUE_LEN 10
+/* Default number of seconds to run each depth with pipeline_sweep */
+#define PIPELINE_SWEEP_SECS 10
+/* Default max. memory (MB) used for caching CRLF-converted messages */
+#define MSG_CACHE_MB 256
+/* Default CPU usage percentage after which imaptest warns that it's the
+   bottleneck */
+#define OVERHEAD_WARN_PERCENT 90
 #define MAX_INLINE_LITERAL_SIZE (1024*32)
 
+struct msg_size_weight {
+	uoff_t max_size;
+	unsigned int weight;
+};
+ARRAY_DEFINE_TYPE(msg_size_weight, struct msg_size_weight);
+
 struct settings {
 	const char *username_template, *username2_template;
 	const char *host, *master_user, *password;
@@ -42,20 +56,48 @@ struct settings {
 	const char *mech;
 	unsigned int port;
 
-	ARRAY_TYPE(const_string) usernames;
+	/* userfile=path, NULL if not used */
+	struct userfile *userfile;
 
 	unsigned int clients_count;
 	unsigned int message_count_threshold;
 	unsigned int checkpoint_interval;
 	unsigned int random_msg_size;
+	/* random_msg_type=rfc822, random_msg_dist=exponential */
+	bool random_msg_rfc822, random_msg_size_exp;
+	/* max. bytes of CRLF-converted messages to keep in memory */
+	uoff_t msg_cache_size;
+	/* sample the messages with these weights, sorted by max_size */
+	ARRAY_TYPE(msg_size_weight) msg_sizes;
 	unsigned int stalled_disconnect_timeout;
+	/* max number of commands a client pipelines */
+	unsigned int pipeline_depth;
+	ARRAY_TYPE(uint) pipeline_sweep_depths;
+	unsigned int pipeline_sweep_secs;
+	/* open-loop command rate per second, 0 = closed-loop */
+	unsigned int arrival_rate;
+	/* number of forked worker processes and this worker's index */
+	unsigned int workers_count, worker_idx;
+	/* latency_breakdown=profile,ip */
+	bool latency_breakdown_profile, latency_breakdown_ip;
+	/* stats_json=path, NULL if not used */
+	const char *stats_json_path;
+	/* stats_http=port on 127.0.0.1, 0 if not used */
+	unsigned int stats_http_port;
+	/* histogram_log=path, NULL if not used */
+	const char *histogram_log_path;
+	/* warn when imaptest's own CPU usage is at least this, 0 = never */
+	unsigned int overhead_warn_percent;
 
 	unsigned int users_rand_start, users_rand_count;
 	unsigned int domains_rand_start, domains_rand_count;
 
-	bool random_states, no_pipelining, disconnect_quit;
+	bool random_states, no_pipelining, disconnect_quit, arrival_constant;
 	bool no_tracking, rawlog, error_quit, own_msgs, own_flags, qresync,
 	     imap4rev2;
+	/* no_tracking, and skip everything that is only used for verifying
+	   the replies */
+	bool benchmark;
 
 	struct ip_addr *ips;
 	unsigned int ip_idx, ips_count;
@@ -0,0 +1,271 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "llist.h"
+#include "str.h"
+#include "net.h"
+#include "write-full.h"
+#include "ostream.h"
+
+#include "settings.h"
+#include "client-state.h"
+#include "workers.h"
+#include "overhead.h"
+#include "stats-export.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Disconnect HTTP clients that don't send their request in time */
+#define STATS_HTTP_TIMEOUT_MSECS (10*1000)
+
+struct stats_http_client {
+	struct stats_http_client *prev, *next;
+
+	int fd;
+	struct io *io;
+	struct timeout *to;
+};
+
+static const struct {
+	const char *name;
+	double percentile;
+} stats_percentiles[] = {
+	{ "p50", 50 },
+	{ "p90", 90 },
+	{ "p99", 99 },
+	{ "p99.9", 99.9 },
+};
+
+static struct ostream *json_output = NULL;
+static int http_fd = -1;
+static struct io *http_io = NULL;
+static struct stats_http_client *http_clients = NULL;
+static struct client_stats last_stats;
+
+static void
+stats_json_append_latencies(string_t *str, const struct latency_histogram *hist)
+{
+	unsigned int i;
+
+	str_printfa(str, "\"usecs\":%llu", (unsigned long long)hist->sum);
+	for (i = 0; i < N_ELEMENTS(stats_percentiles); i++) {
+		str_printfa(str, ",\"%s\":%llu", stats_percentiles[i].name,
+			    (unsigned long long)
+			    latency_histogram_get_percentile(hist,
+				stats_percentiles[i].percentile));
+	}
+	str_printfa(str, ",\"max\":%llu", (unsigned long long)hist->max);
+}
+
+static void stats_json_write(const struct client_stats *stats,
+			     const struct overhead_stats *overhead)
+{
+	string_t *str = t_str_new(1024);
+	const struct latency_histogram *hist;
+	bool first = TRUE;
+	unsigned int i;
+
+	str_printfa(str, "{\"time\":%ld,\"clients\":{"
+		    "\"connected\":%u,\"banner_wait\":%u,\"created\":%u,"
+		    "\"target\":%u,\"stalled\":%u,\"arrivals_pending\":%u},"
+		    "\"disconnects\":%u,"
+		    "\"lmtp\":{\"active\":%u,\"failures\":%u},\"states\":{",
+		    (long)ioloop_time,
+		    stats->clients_count - stats->banner_waits,
+		    stats->banner_waits, stats->created_count,
+		    stats->target_count, stats->stall_count,
+		    stats->arrivals_pending, stats->disconnects,
+		    stats->lmtp_active, stats->lmtp_failures);
+	for (i = 1; i < STATE_COUNT; i++) {
+		hist = &latencies[i];
+		if (counters[i] == 0 && hist->count == 0)
+			continue;
+
+		/* state names are plain uppercase words, which don't need
+		   any JSON escaping */
+		str_printfa(str, "%s\"%s\":{\"count\":%u,\"timed\":%llu,",
+			    first ? "" : ",", states[i].name, counters[i],
+			    (unsigned long long)hist->count);
+		stats_json_append_latencies(str, hist);
+		str_append_c(str, '}');
+		first = FALSE;
+	}
+	str_append(str, "},\"overhead\":{");
+	for (i = 0; i < OVERHEAD_COUNT; i++) {
+		str_printfa(str, "\"%s_usecs\":%llu,", overhead_names[i],
+			    (unsigned long long)overhead->usecs[i]);
+	}
+	str_printfa(str, "\"wait_usecs\":%llu,\"cpu_percent\":%u}}\n",
+		    (unsigned long long)overhead->wait_usecs,
+		    overhead->cpu_percent);
+
+	o_stream_nsend(json_output, str_data(str), str_len(str));
+	if (o_stream_flush(json_output) < 0) {
+		i_error("write(%s) failed: %s", conf.stats_json_path,
+			o_stream_get_error(json_output));
+		o_stream_destroy(&json_output);
+	}
+}
+
+void stats_export_interval(const struct client_stats *stats,
+			   const struct overhead_stats *overhead)
+{
+	last_stats = *stats;
+	if (json_output != NULL)
+		stats_json_write(stats, overhead);
+}
+
+static void stats_http_append_metrics(string_t *str)
+{
+	const struct latency_histogram *hist;
+	unsigned int i, j;
+
+	/* everything comes from the totals, which are updated once per
+	   interval, so the counters and the latencies are consistent */
+	str_append(str,
+		"# HELP imaptest_commands_total Commands sent.\n"
+		"# TYPE imaptest_commands_total counter\n");
+	for (i = 1; i < STATE_COUNT; i++) {
+		if (total_counters[i] == 0)
+			continue;
+		str_printfa(str, "imaptest_commands_total{state=\"%s\"} %u\n",
+			    states[i].name, total_counters[i]);
+	}
+
+	str_append(str,
+		"# HELP imaptest_command_latency_seconds Command latencies.\n"
+		"# TYPE imaptest_command_latency_seconds summary\n");
+	for (i = 1; i < STATE_COUNT; i++) {
+		hist = &total_latencies[i];
+		if (hist->count == 0)
+			continue;
+		for (j = 0; j < N_ELEMENTS(stats_percentiles); j++) {
+			str_printfa(str, "imaptest_command_latency_seconds"
+				    "{state=\"%s\",quantile=\"%g\"} %.6f\n",
+				    states[i].name,
+				    stats_percentiles[j].percentile / 100,
+				    latency_histogram_get_percentile(hist,
+					stats_percentiles[j].percentile) /
+				    1000000.0);
+		}
+		str_printfa(str, "imaptest_command_latency_seconds_sum"
+			    "{state=\"%s\"} %.6f\n",
+			    states[i].name, hist->sum / 1000000.0);
+		str_printfa(str, "imaptest_command_latency_seconds_count"
+			    "{state=\"%s\"} %llu\n",
+			    states[i].name, (unsigned long long)hist->count);
+	}
+
+	str_printfa(str,
+		"# TYPE imaptest_clients_connected gauge\n"
+		"imaptest_clients_connected %u\n"
+		"# TYPE imaptest_clients_stalled gauge\n"
+		"imaptest_clients_stalled %u\n"
+		"# TYPE imaptest_arrivals_pending gauge\n"
+		"imaptest_arrivals_pending %u\n"
+		"# TYPE imaptest_disconnects_total counter\n"
+		"imaptest_disconnects_total %u\n"
+		"# TYPE imaptest_lmtp_deliveries_active gauge\n"
+		"imaptest_lmtp_deliveries_active %u\n"
+		"# TYPE imaptest_lmtp_failures_total counter\n"
+		"imaptest_lmtp_failures_total %u\n",
+		last_stats.clients_count - last_stats.banner_waits,
+		last_stats.stall_count, last_stats.arrivals_pending,
+		last_stats.disconnects, last_stats.lmtp_active,
+		last_stats.lmtp_failures);
+}
+
+static void stats_http_client_free(struct stats_http_client *client)
+{
+	DLLIST_REMOVE(&http_clients, client);
+	io_remove(&client->io);
+	timeout_remove(&client->to);
+	i_close_fd(&client->fd);
+	i_free(client);
+}
+
+static void stats_http_client_input(struct stats_http_client *client)
+{
+	char buf[1024];
+	string_t *body, *str;
+
+	/* the request is expected to fit into a single packet. whatever it
+	   asks for, it gets the metrics. */
+	if (read(client->fd, buf, sizeof(buf)) <= 0) {
+		stats_http_client_free(client);
+		return;
+	}
+
+	body = t_str_new(4096);
+	stats_http_append_metrics(body);
+	str = t_str_new(str_len(body) + 128);
+	str_printfa(str, "HTTP/1.0 200 OK\r\n"
+		    "Content-Type: text/plain; version=0.0.4\r\n"
+		    "Content-Length: %zu\r\n"
+		    "Connection: close\r\n\r\n", str_len(body));
+	str_append_str(str, body);
+	if (write_full(client->fd, str_data(str), str_len(str)) < 0)
+		i_error("stats_http: write() failed: %m");
+	stats_http_client_free(client);
+}
+
+static void stats_http_accept(void *context ATTR_UNUSED)
+{
+	struct stats_http_client *client;
+	int fd;
+
+	fd = net_accept(http_fd, NULL, NULL);
+	if (fd == -1)
+		return;
+	if (fd < 0) {
+		i_error("stats_http: accept() failed: %m");
+		return;
+	}
+	client = i_new(struct stats_http_client, 1);
+	client->fd = fd;
+	client->io = io_add(fd, IO_READ, stats_http_client_input, client);
+	client->to = timeout_add(STATS_HTTP_TIMEOUT_MSECS,
+				 stats_http_client_free, client);
+	DLLIST_PREPEND(&http_clients, client);
+}
+
+void stats_export_init(void)
+{
+	struct ip_addr ip;
+	in_port_t port;
+	int fd;
+
+	if (workers_is_worker())
+		return;
+
+	if (conf.stats_json_path != NULL) {
+		fd = creat(conf.stats_json_path, 0600);
+		if (fd == -1)
+			i_fatal("creat(%s) failed: %m", conf.stats_json_path);
+		json_output = o_stream_create_fd_file_autoclose(&fd, 0);
+	}
+	if (conf.stats_http_port != 0) {
+		if (net_addr2ip("127.0.0.1", &ip) < 0)
+			i_unreached();
+		port = conf.stats_http_port;
+		http_fd = net_listen(&ip, &port, 16);
+		if (http_fd == -1) {
+			i_fatal("listen(127.0.0.1:%u) failed: %m",
+				conf.stats_http_port);
+		}
+		http_io = io_add(http_fd, IO_READ, stats_http_accept, NULL);
+	}
+}
+
+void stats_export_deinit(void)
+{
+	while (http_clients != NULL)
+		stats_http_client_free(http_clients);
+	io_remove(&http_io);
+	if (http_fd != -1)
+		i_close_fd(&http_fd);
+	if (json_output != NULL)
+		o_stream_destroy(&json_output);
+}
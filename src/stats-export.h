@@ -0,0 +1,19 @@
+#ifndef STATS_EXPORT_H
+#define STATS_EXPORT_H
+
+struct client_stats;
+struct overhead_stats;
+
+/* Open the stats_json file and start listening on the stats_http port.
+   Must be called after the ioloop has been created. Does nothing in the
+   worker processes, since the parent has all their statistics. */
+void stats_export_init(void);
+void stats_export_deinit(void);
+
+/* Write the current interval's statistics as a JSON line and remember the
+   client statistics for the HTTP endpoint. Must be called before the
+   interval's counters and latencies are moved to the totals. */
+void stats_export_interval(const struct client_stats *stats,
+			   const struct overhead_stats *overhead);
+
+#endif
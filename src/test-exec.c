@@ -1055,7 +1055,7 @@ static void init_callback(struct imap_client *client, struct command *command,
 		return;
 	}
 	if (ctx->listing) {
-		if (array_count(&client->commands) > 0)
+		if (client->commands_count > 0)
 			return;
 		/* both LSUB and LIST done */
 		ctx->listing = FALSE;
@@ -12,12 +12,12 @@
 #include "mailbox.h"
 #include "mailbox-source.h"
 #include "user.h"
+#include "userfile.h"
 #include "var-expand.h"
 
 #include <stdlib.h>
 
 static HASH_TABLE(const char *, struct user *) users_hash;
-static ARRAY_TYPE(user) users = ARRAY_INIT;
 static struct profile *users_profile;
 
 static inline const char *
@@ -47,15 +47,11 @@ t_nagfree_strdup_printf(char const* format, ...)
 	return ret;
 }
 
-struct user *user_get(const char *username, struct mailbox_source *source)
+struct user *user_new(const char *username, struct mailbox_source *source)
 {
 	struct user *user;
 	pool_t pool;
 
-	user = hash_table_lookup(users_hash, username);
-	if (user != NULL)
-		return user;
-
 	pool = pool_alloconly_create("user", 1024*2);
 	user = p_new(pool, struct user, 1);
 	user->pool = pool;
@@ -63,8 +59,19 @@ struct user *user_get(const char *username, struct mailbox_source *source)
 	user->password = conf.password;
 	user->mailbox_source = source;
 	mailbox_source_ref(user->mailbox_source);
-	user->next_min_timestamp = INT_MAX;
 	p_array_init(&user->clients, user->pool, 2);
+	return user;
+}
+
+struct user *user_get(const char *username, struct mailbox_source *source)
+{
+	struct user *user;
+
+	user = hash_table_lookup(users_hash, username);
+	if (user != NULL)
+		return user;
+
+	user = user_new(username, source);
 	hash_table_insert(users_hash, user->username, user);
 	return user;
 }
@@ -72,21 +79,18 @@ struct user *user_get(const char *username, struct mailbox_source *source)
 static struct user *user_get_random_from_conf(struct mailbox_source *source)
 {
 	static int prev_user = 0, prev_domain = 0;
-	const char *const *userp, *p, *username;
+	const char *username, *password;
 	struct user *user;
 	unsigned int i;
 
-	if (array_is_created(&conf.usernames)) {
-		i = i_rand_limit(array_count(&conf.usernames));
-		userp = array_idx(&conf.usernames, i);
-		p = strchr(*userp, ':');
-		if (p == NULL) {
-			user = user_get(*userp, source);
-		} else {
-			user = user_get(t_strdup_until(*userp, p), source);
-			if (strncmp(p + 1, "{PLAIN}", 7) == 0)
-				p += 7;
-			user->password = p_strdup(user->pool, p+1);
+	if (conf.userfile != NULL) {
+		i = i_rand_limit(userfile_get_count(conf.userfile));
+		userfile_get(conf.userfile, i, &username, &password);
+		user = user_get(username, source);
+		if (password != NULL) {
+			if (str_begins_with(password, "{PLAIN}"))
+				password += 7;
+			user->password = password;
 		}
 	} else {
 		prev_user = random() % conf.users_rand_count + conf.users_rand_start;
@@ -101,12 +105,14 @@ static struct user *user_get_random_from_conf(struct mailbox_source *source)
 
 #define USER_CLIENT_CAN_CONNECT(uc) \
 	((uc->last_logout <= 0 ? \
-	 (ioloop_time >= uc->user->timestamps[USER_TIMESTAMP_LOGIN]) : \
-	 (ioloop_time - uc->last_logout >= (time_t)uc->profile->login_interval)) && \
+	 (users_get_ioloop_msecs() >= \
+	  uc->user->timestamps[USER_TIMESTAMP_LOGIN]) : \
+	 (users_get_ioloop_msecs() - uc->last_logout >= \
+	  (int64_t)uc->profile->login_interval * 1000)) && \
 	array_count(&uc->clients) < uc->profile->connection_max_count)
 
 
-static bool user_can_connect_clients(struct user *user)
+bool user_can_connect_clients(struct user *user)
 {
 	struct user_client *const *clients;
 	unsigned int i, count;
@@ -122,28 +128,23 @@ static bool user_can_connect_clients(struct user *user)
 
 bool user_get_random(struct mailbox_source *source, struct user **user_r)
 {
-	struct user *const *u;
-	unsigned int start_idx, i, count;
-
 	if (users_profile == NULL) {
 		*user_r = user_get_random_from_conf(source);
 		return TRUE;
 	}
-
-	u = array_get(&users, &count);
-	start_idx = i_rand_limit(count);
-	for (i = 0; i < count; i++) {
-		unsigned int idx = (i + start_idx) % count;
-		if (user_can_connect_clients(u[idx])) {
-			*user_r = u[idx];
-			return TRUE;
-		}
-	}
-	return FALSE;
+	return profile_get_random_user(user_r);
 }
 
-static void user_free(struct user *user)
+void user_free(struct user **_user)
 {
+	struct user *user = *_user;
+	struct user_client *uc;
+
+	*_user = NULL;
+	array_foreach_elem(&user->clients, uc) {
+		if (uc->pop3_uidls_pool != NULL)
+			pool_unref(&uc->pop3_uidls_pool);
+	}
 	mailbox_source_unref(&user->mailbox_source);
 	pool_unref(&user->pool);
 }
@@ -190,6 +191,9 @@ void user_remove_client(struct user *user, struct client *client)
 			array_delete(&client->user_client->clients, i, 1);
 			if (count == 1 && user->active_client == client->user_client)
 				user_update_active_client(user);
+			if (user->active_client == NULL &&
+			    user->profile != NULL)
+				profile_user_disconnected(user);
 			return;
 		}
 	}
@@ -222,25 +226,31 @@ bool user_get_new_client_profile(struct user *user,
 	return TRUE;
 }
 
-time_t user_get_next_login_time(struct user *user)
+int64_t users_get_ioloop_msecs(void)
+{
+	return (int64_t)ioloop_timeval.tv_sec * 1000 +
+		ioloop_timeval.tv_usec / 1000;
+}
+
+int64_t user_get_next_login_time(struct user *user)
 {
 	struct user_client *const *user_clients;
 	unsigned int i, uc_count;
-	time_t next_login, lowest_next_login_time = INT_MAX;
+	int64_t next_login, lowest_next_login_time = INT64_MAX;
 
 	if (user->profile == NULL)
-		return ioloop_time;
+		return users_get_ioloop_msecs();
 
 	user_clients = array_get(&user->clients, &uc_count);
 	for (i = 0; i < uc_count; i++) {
 		if (user_clients[i]->last_logout <= 0)
 			continue;
 		next_login = user_clients[i]->last_logout +
-			user_clients[i]->profile->login_interval;
+			(int64_t)user_clients[i]->profile->login_interval * 1000;
 		if (lowest_next_login_time > next_login)
 			lowest_next_login_time = next_login;
 	}
-	if (lowest_next_login_time == INT_MAX) {
+	if (lowest_next_login_time == INT64_MAX) {
 		/* first login for user */
 		return user->timestamps[USER_TIMESTAMP_LOGIN];
 	}
@@ -302,23 +312,11 @@ user_get_mailbox_cache(struct user_client *uc, const char *name)
 	}
 	mailbox = p_new(uc->user->pool, struct user_mailbox_cache, 1);
 	mailbox->mailbox_name = p_strdup(uc->user->pool, name);
-	mailbox->next_action_timestamp = (time_t)-1;
+	mailbox->next_action_timestamp = -1;
 	array_append(&uc->mailboxes, &mailbox, 1);
 	return mailbox;
 }
 
-static int users_min_timestamp_cmp(struct user *const *u1,
-				   struct user *const *u2)
-{
-	return (*u1)->next_min_timestamp - (*u2)->next_min_timestamp;
-}
-
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void)
-{
-	array_sort(&users, users_min_timestamp_cmp);
-	return &users;
-}
-
 void users_free_all(void)
 {
 	const char *username;
@@ -327,12 +325,10 @@ void users_free_all(void)
 
 	iter = hash_table_iterate_init(users_hash);
 	while (hash_table_iterate(iter, users_hash, &username, &user))
-		user_free(user);
+		user_free(&user);
 	hash_table_iterate_deinit(&iter);
 
 	hash_table_clear(users_hash, FALSE);
-	if (array_is_created(&users))
-		array_clear(&users);
 }
 
 void users_init(struct profile *profile, struct mailbox_source *source)
@@ -341,7 +337,7 @@ void users_init(struct profile *profile, struct mailbox_source *source)
 	users_profile = profile;
 
 	if (profile != NULL)
-		profile_add_users(profile, &users, source);
+		profile_add_users(profile, source);
 }
 
 void users_deinit(void)
@@ -349,6 +345,4 @@ void users_deinit(void)
 	users_free_all();
 
 	hash_table_destroy(&users_hash);
-	if (array_is_created(&users))
-		array_free(&users);
 }
@@ -10,7 +10,8 @@ struct user_mailbox_cache {
 	uint32_t uidnext;
 	uint64_t highest_modseq;
 
-	time_t next_action_timestamp;
+	/* msecs, -1 = none */
+	int64_t next_action_timestamp;
 	uint32_t last_action_uid;
 	bool last_action_uid_body_fetched;
 };
@@ -28,7 +29,8 @@ enum user_timestamp {
 struct user_client {
 	struct user *user;
 	struct profile_client *profile;
-	time_t last_logout;
+	/* msecs */
+	int64_t last_logout;
 
 	/* connections created by this client */
 	ARRAY(struct client *) clients;
@@ -46,6 +48,8 @@ struct user {
 	const char *username;
 	const char *password;
 	const struct profile_user *profile;
+	/* profile's compact index for the user */
+	unsigned int profile_slot;
 	struct mailbox_source *mailbox_source;
 
 	/* all of the user's clients (e.g. desktop client, mobile client) */
@@ -54,23 +58,31 @@ struct user {
 	   connected currently (somewhat randomly switches between clients) */
 	struct user_client *active_client;
 
-	time_t timestamps[USER_TIMESTAMP_COUNT];
-	time_t next_min_timestamp;
+	/* The profile scheduler's timestamps are in milliseconds, so that
+	   events of many users don't all happen at the start of a second.
+	   -1 = none */
+	int64_t timestamps[USER_TIMESTAMP_COUNT];
 };
 ARRAY_DEFINE_TYPE(user, struct user *);
 
 struct user *user_get(const char *username, struct mailbox_source *source);
+/* Allocate a new user without adding it to the username lookup, so
+   user_get() won't return it. Free it with user_free(). */
+struct user *user_new(const char *username, struct mailbox_source *source);
+void user_free(struct user **user);
 bool user_get_random(struct mailbox_source *source, struct user **user_r);
+/* Returns TRUE if any of the user's clients can connect now. */
+bool user_can_connect_clients(struct user *user);
 void user_add_client(struct user *user, struct client *client);
 void user_remove_client(struct user *user, struct client *client);
 
 bool user_get_new_client_profile(struct user *user,
 				 struct user_client **user_client_r);
-time_t user_get_next_login_time(struct user *user);
+int64_t user_get_next_login_time(struct user *user);
+/* Returns ioloop's current time in milliseconds */
+int64_t users_get_ioloop_msecs(void);
 const char *user_get_new_mailbox(struct client *client);
 
-const ARRAY_TYPE(user) *users_get_sort_by_min_timestamp(void);
-
 struct imap_client *
 user_find_client_by_mailbox(struct user_client *uc, const char *mailbox);
 struct user_mailbox_cache *
@@ -0,0 +1,172 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "array.h"
+#include "buffer.h"
+#include "userfile.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+
+struct userfile_user {
+	const char *username, *password;
+};
+
+struct userfile {
+	char *path;
+	/* private writable mapping of the file, or with non-regular files
+	   its contents read into memory. The LFs and the password separators
+	   are replaced with NULs. */
+	char *data;
+	size_t data_size;
+	bool mmaped;
+	/* the last line, if the file doesn't end with LF */
+	char *last_line;
+
+	ARRAY(struct userfile_user) users;
+};
+
+static void userfile_add_line(struct userfile *file, char *line, char *end)
+{
+	struct userfile_user *user;
+	char *p;
+
+	if (end > line && end[-1] == '\r')
+		end--;
+	*end = '\0';
+	if (*line == '\0' || *line == ':')
+		return;
+
+	user = array_append_space(&file->users);
+	user->username = line;
+	p = memchr(line, ':', end - line);
+	if (p != NULL) {
+		*p++ = '\0';
+		user->password = p;
+	}
+}
+
+static void userfile_parse(struct userfile *file)
+{
+	char *data = file->data, *end = data + file->data_size, *lf;
+
+	while (data < end) {
+		lf = memchr(data, '\n', end - data);
+		if (lf == NULL) {
+			/* there's no space for the NUL in the data */
+			file->last_line = i_strndup(data, end - data);
+			userfile_add_line(file, file->last_line,
+					  file->last_line + (end - data));
+			break;
+		}
+		userfile_add_line(file, data, lf);
+		data = lf + 1;
+	}
+}
+
+static void userfile_mmap(struct userfile *file, int fd, off_t size)
+{
+	void *mmap_base;
+
+	file->data_size = size;
+	mmap_base = mmap(NULL, file->data_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE, fd, 0);
+	if (mmap_base == MAP_FAILED)
+		i_fatal("mmap(%s) failed: %m", file->path);
+	file->data = mmap_base;
+	file->mmaped = TRUE;
+	(void)madvise(file->data, file->data_size, MADV_SEQUENTIAL);
+}
+
+static void userfile_read(struct userfile *file, int fd)
+{
+	buffer_t *buf = buffer_create_dynamic(default_pool, IO_BLOCK_SIZE);
+	ssize_t ret;
+
+	do {
+		ret = read(fd, buffer_append_space_unsafe(buf, IO_BLOCK_SIZE),
+			   IO_BLOCK_SIZE);
+		buffer_set_used_size(buf, buf->used - IO_BLOCK_SIZE +
+				     (ret < 0 ? 0 : ret));
+	} while (ret > 0 || (ret < 0 && errno == EINTR));
+	if (ret < 0)
+		i_fatal("read(%s) failed: %m", file->path);
+
+	file->data_size = buf->used;
+	file->data = buffer_free_without_data(&buf);
+}
+
+struct userfile *userfile_load(const char *path)
+{
+	struct userfile *file;
+	struct stat st;
+	int fd;
+
+	file = i_new(struct userfile, 1);
+	file->path = i_strdup(path);
+
+	fd = open(path, O_RDONLY);
+	if (fd == -1)
+		i_fatal("open(%s) failed: %m", path);
+	if (fstat(fd, &st) < 0)
+		i_fatal("fstat(%s) failed: %m", path);
+	if (!S_ISREG(st.st_mode)) {
+		/* e.g. /dev/stdin or a pipe, which can't be mmap()ed */
+		userfile_read(file, fd);
+	} else if (st.st_size == 0)
+		i_fatal("No usernames in file %s", path);
+	else
+		userfile_mmap(file, fd, st.st_size);
+	if (close(fd) < 0)
+		i_error("close(%s) failed: %m", path);
+
+	/* assume ~32 bytes per line */
+	i_array_init(&file->users, file->data_size / 32 + 16);
+	userfile_parse(file);
+	if (array_count(&file->users) == 0)
+		i_fatal("No usernames in file %s", path);
+	return file;
+}
+
+void userfile_free(struct userfile **_file)
+{
+	struct userfile *file = *_file;
+
+	*_file = NULL;
+	if (!file->mmaped)
+		i_free(file->data);
+	else if (munmap(file->data, file->data_size) < 0)
+		i_error("munmap(%s) failed: %m", file->path);
+	array_free(&file->users);
+	i_free(file->last_line);
+	i_free(file->path);
+	i_free(file);
+}
+
+unsigned int userfile_get_count(const struct userfile *file)
+{
+	return array_count(&file->users);
+}
+
+void userfile_get(const struct userfile *file, unsigned int idx,
+		  const char **username_r, const char **password_r)
+{
+	const struct userfile_user *user = array_idx(&file->users, idx);
+
+	*username_r = user->username;
+	*password_r = user->password;
+}
+
+void userfile_keep_share(struct userfile *file,
+			 unsigned int n, unsigned int count)
+{
+	struct userfile_user *users;
+	unsigned int i, dest, users_count;
+
+	users = array_get_modifiable(&file->users, &users_count);
+	for (i = n, dest = 0; i < users_count; i += count)
+		users[dest++] = users[i];
+	array_delete(&file->users, dest, users_count - dest);
+}
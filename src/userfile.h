@@ -0,0 +1,22 @@
+#ifndef USERFILE_H
+#define USERFILE_H
+
+/* "username[:password]" lines of a userfile, split once into a table so
+   that looking up a user doesn't need any parsing or allocations. */
+struct userfile;
+
+/* Load the userfile or fail with i_fatal(). Empty lines and lines beginning
+   with ':' are skipped. */
+struct userfile *userfile_load(const char *path);
+void userfile_free(struct userfile **file);
+
+unsigned int userfile_get_count(const struct userfile *file);
+/* password_r is NULL if the line has no password. The strings are valid
+   until the userfile is freed. */
+void userfile_get(const struct userfile *file, unsigned int idx,
+		  const char **username_r, const char **password_r);
+/* Keep only the users whose index % count == n */
+void userfile_keep_share(struct userfile *file,
+			 unsigned int n, unsigned int count);
+
+#endif
@@ -0,0 +1,416 @@
+/* Copyright (c) 2026 ImapTest authors, see the included COPYING file */
+
+#include "lib.h"
+#include "ioloop.h"
+#include "array.h"
+#include "str.h"
+#include "strescape.h"
+#include "istream.h"
+#include "ostream.h"
+
+#include "settings.h"
+#include "client-state.h"
+#include "latency-breakdown.h"
+#include "overhead.h"
+#include "profile.h"
+#include "userfile.h"
+#include "workers.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <signal.h>
+#include <sys/wait.h>
+
+struct worker {
+	unsigned int idx;
+	pid_t pid;
+	int fd;
+
+	struct istream *input;
+	struct io *io;
+
+	/* latest statistics received from the worker */
+	struct client_stats stats;
+	ARRAY_TYPE(string) stalled_lines, new_stalled_lines;
+};
+
+static bool workers_parent = FALSE;
+static ARRAY(struct worker) workers;
+static unsigned int workers_running_count;
+static int workers_exit_code = 0;
+
+static int worker_fd = -1;
+static struct ostream *worker_output;
+/* there are fewer users than workers, so each worker uses all of them */
+static bool workers_share_users = FALSE;
+
+static void worker_settings_partition(struct profile *profile)
+{
+	unsigned int idx = conf.worker_idx, count = conf.workers_count;
+	unsigned int start, end;
+
+	conf.clients_count = conf.clients_count / count +
+		(idx < conf.clients_count % count ? 1 : 0);
+	conf.arrival_rate = conf.arrival_rate * (idx + 1) / count -
+		conf.arrival_rate * idx / count;
+
+	if (profile != NULL) {
+		/* users are split by profile_add_users() */
+		if (profile->lmtp_max_parallel_count > 0) {
+			profile->lmtp_max_parallel_count =
+				I_MAX(profile->lmtp_max_parallel_count / count, 1);
+		}
+	} else if (workers_share_users) {
+		/* splitting would leave some workers without users */
+	} else if (conf.userfile != NULL) {
+		userfile_keep_share(conf.userfile, idx, count);
+	} else {
+		start = conf.users_rand_count * idx / count;
+		end = conf.users_rand_count * (idx + 1) / count;
+		conf.users_rand_start += start;
+		conf.users_rand_count = end - start;
+	}
+}
+
+static void workers_check_settings(struct profile *profile)
+{
+	unsigned int users_count;
+
+	if (profile == NULL && conf.clients_count < conf.workers_count) {
+		i_fatal("workers=%u requires at least as many clients",
+			conf.workers_count);
+	}
+	if (conf.arrival_rate > 0 && conf.arrival_rate < conf.workers_count) {
+		i_fatal("workers=%u requires rate to be at least as large",
+			conf.workers_count);
+	}
+	if (profile != NULL)
+		return;
+
+	if (conf.userfile != NULL)
+		users_count = userfile_get_count(conf.userfile);
+	else if (strchr(conf.username_template, '%') == NULL)
+		users_count = 1;
+	else
+		users_count = conf.users_rand_count;
+	if (users_count >= conf.workers_count)
+		return;
+
+	/* the mailbox states are tracked per process, so the workers must
+	   not share users */
+	if (!conf.no_tracking) {
+		i_fatal("workers=%u requires at least as many users "
+			"(or no_tracking)", conf.workers_count);
+	}
+	workers_share_users = TRUE;
+}
+
+static void worker_child_init(unsigned int idx, int fd)
+{
+	struct worker *worker;
+
+	array_foreach_modifiable(&workers, worker)
+		i_close_fd(&worker->fd);
+	array_free(&workers);
+
+	conf.worker_idx = idx;
+	worker_fd = fd;
+	i_set_failure_prefix("worker %u: ", idx + 1);
+	/* each worker needs its own random sequence, while still keeping
+	   seed=SEED runs repeatable */
+	srand(rand() + idx);
+}
+
+bool workers_fork(struct profile *profile)
+{
+	struct worker *worker;
+	unsigned int i;
+	int fd[2];
+	pid_t pid;
+
+	workers_check_settings(profile);
+
+	i_array_init(&workers, conf.workers_count);
+	for (i = 0; i < conf.workers_count; i++) {
+		if (pipe(fd) < 0)
+			i_fatal("pipe() failed: %m");
+
+		/* don't let the workers duplicate anything buffered so far */
+		fflush(stdout);
+		pid = fork();
+		if (pid < 0)
+			i_fatal("fork() failed: %m");
+		if (pid == 0) {
+			i_close_fd(&fd[0]);
+			worker_child_init(i, fd[1]);
+			worker_settings_partition(profile);
+			return TRUE;
+		}
+		i_close_fd(&fd[1]);
+
+		worker = array_append_space(&workers);
+		worker->idx = i;
+		worker->pid = pid;
+		worker->fd = fd[0];
+	}
+	workers_parent = TRUE;
+	workers_running_count = conf.workers_count;
+	return FALSE;
+}
+
+static void worker_stalled_lines_free(ARRAY_TYPE(string) *lines)
+{
+	char **line;
+
+	array_foreach_modifiable(lines, line)
+		i_free(*line);
+	array_clear(lines);
+}
+
+static int worker_input_line(struct worker *worker, const char *line)
+{
+	const char *const *args = t_strsplit_tabescaped(line);
+	unsigned int idx, counter, timer_count;
+	unsigned long long usecs;
+	char *stalled;
+	ARRAY_TYPE(string) tmp;
+
+	if (args[0] == NULL)
+		return -1;
+
+	if (strcmp(args[0], "state") == 0) {
+		/* state <idx> <counter> <timer count> <timer usecs> <hist>
+		   <corrected hist> */
+		if (str_array_length(args) != 7 ||
+		    str_to_uint(args[1], &idx) < 0 || idx >= STATE_COUNT ||
+		    str_to_uint(args[2], &counter) < 0 ||
+		    str_to_uint(args[3], &timer_count) < 0 ||
+		    str_to_ullong(args[4], &usecs) < 0 ||
+		    latency_histogram_import(&latencies[idx], args[5]) < 0 ||
+		    latency_histogram_import(&corrected_latencies[idx],
+					     args[6]) < 0)
+			return -1;
+		counters[idx] += counter;
+		timer_counts[idx] += timer_count;
+		timers[idx] += usecs;
+	} else if (strcmp(args[0], "breakdown") == 0) {
+		if (latency_breakdown_import(args + 1) < 0)
+			return -1;
+	} else if (strcmp(args[0], "overhead") == 0) {
+		if (overhead_import(args + 1) < 0)
+			return -1;
+	} else if (strcmp(args[0], "clients") == 0) {
+		/* clients <connected> <created> <target> <banner> <stalled>
+		   <arrivals> <disconnects> <lmtp active> <lmtp failures> */
+		if (str_array_length(args) != 10 ||
+		    str_to_uint(args[1], &worker->stats.clients_count) < 0 ||
+		    str_to_uint(args[2], &worker->stats.created_count) < 0 ||
+		    str_to_uint(args[3], &worker->stats.target_count) < 0 ||
+		    str_to_uint(args[4], &worker->stats.banner_waits) < 0 ||
+		    str_to_uint(args[5], &worker->stats.stall_count) < 0 ||
+		    str_to_uint(args[6], &worker->stats.arrivals_pending) < 0 ||
+		    str_to_uint(args[7], &worker->stats.disconnects) < 0 ||
+		    str_to_uint(args[8], &worker->stats.lmtp_active) < 0 ||
+		    str_to_uint(args[9], &worker->stats.lmtp_failures) < 0)
+			return -1;
+	} else if (strcmp(args[0], "stalled") == 0) {
+		if (str_array_length(args) != 2)
+			return -1;
+		stalled = i_strdup(args[1]);
+		array_append(&worker->new_stalled_lines, &stalled, 1);
+	} else if (strcmp(args[0], "end") == 0) {
+		worker_stalled_lines_free(&worker->stalled_lines);
+		tmp = worker->stalled_lines;
+		worker->stalled_lines = worker->new_stalled_lines;
+		worker->new_stalled_lines = tmp;
+	} else {
+		return -1;
+	}
+	return 0;
+}
+
+static void worker_finish(struct worker *worker)
+{
+	int status;
+
+	io_remove(&worker->io);
+	i_stream_destroy(&worker->input);
+	i_zero(&worker->stats);
+	worker_stalled_lines_free(&worker->stalled_lines);
+
+	if (waitpid(worker->pid, &status, 0) < 0)
+		i_error("waitpid(%s) failed: %m", dec2str(worker->pid));
+	else if (WIFSIGNALED(status)) {
+		i_error("worker %u (pid %s) killed with signal %d",
+			worker->idx + 1, dec2str(worker->pid),
+			WTERMSIG(status));
+		workers_exit_code = I_MAX(workers_exit_code, 1);
+	} else if (WIFEXITED(status)) {
+		workers_exit_code = I_MAX(workers_exit_code,
+					  WEXITSTATUS(status));
+	}
+	worker->pid = 0;
+
+	i_assert(workers_running_count > 0);
+	if (--workers_running_count == 0)
+		io_loop_stop(current_ioloop);
+}
+
+static void worker_input(struct worker *worker)
+{
+	const char *line;
+	int ret = 0;
+
+	while (ret == 0 &&
+	       (line = i_stream_read_next_line(worker->input)) != NULL) {
+		T_BEGIN {
+			ret = worker_input_line(worker, line);
+		} T_END;
+		if (ret < 0) {
+			i_error("worker %u sent invalid input: %s",
+				worker->idx + 1, line);
+		}
+	}
+	if (worker->input->stream_errno != 0) {
+		i_error("read(worker %u) failed: %s", worker->idx + 1,
+			i_stream_get_error(worker->input));
+	}
+	if (ret < 0 || worker->input->eof || worker->input->stream_errno != 0) {
+		if (ret < 0)
+			(void)kill(worker->pid, SIGTERM);
+		worker_finish(worker);
+	}
+}
+
+void workers_init(void)
+{
+	struct worker *worker;
+
+	if (!workers_parent) {
+		if (worker_fd != -1)
+			worker_output = o_stream_create_fd_autoclose(&worker_fd, (size_t)-1);
+		return;
+	}
+
+	array_foreach_modifiable(&workers, worker) {
+		i_array_init(&worker->stalled_lines, 8);
+		i_array_init(&worker->new_stalled_lines, 8);
+		worker->input = i_stream_create_fd_autoclose(&worker->fd, (size_t)-1);
+		worker->io = io_add_istream(worker->input, worker_input, worker);
+	}
+}
+
+void workers_deinit(void)
+{
+	struct worker *worker;
+
+	if (worker_output != NULL) {
+		if (o_stream_finish(worker_output) < 0) {
+			i_error("write(parent) failed: %s",
+				o_stream_get_error(worker_output));
+		}
+		o_stream_destroy(&worker_output);
+	}
+	if (!workers_parent)
+		return;
+
+	/* we were told to stop immediately - don't wait for the rest */
+	array_foreach_modifiable(&workers, worker) {
+		if (worker->pid == 0)
+			continue;
+		(void)kill(worker->pid, SIGTERM);
+		worker_finish(worker);
+	}
+	array_foreach_modifiable(&workers, worker) {
+		worker_stalled_lines_free(&worker->new_stalled_lines);
+		array_free(&worker->stalled_lines);
+		array_free(&worker->new_stalled_lines);
+	}
+	array_free(&workers);
+}
+
+bool workers_is_parent(void)
+{
+	return workers_parent;
+}
+
+bool workers_is_worker(void)
+{
+	return conf.workers_count > 1 && !workers_parent;
+}
+
+bool workers_have_running(void)
+{
+	return workers_running_count > 0;
+}
+
+int workers_get_exit_code(void)
+{
+	return workers_exit_code;
+}
+
+void worker_send_stats(const struct client_stats *stats,
+		       const ARRAY_TYPE(const_string) *stalled_lines)
+{
+	string_t *str = t_str_new(1024);
+	const char *const *line;
+	unsigned int i;
+
+	for (i = 0; i < STATE_COUNT; i++) {
+		if (counters[i] == 0 && timer_counts[i] == 0)
+			continue;
+
+		str_printfa(str, "state\t%u\t%u\t%u\t%llu\t", i, counters[i],
+			    timer_counts[i], timers[i]);
+		latency_histogram_export(&latencies[i], str);
+		str_append_c(str, '\t');
+		latency_histogram_export(&corrected_latencies[i], str);
+		str_append_c(str, '\n');
+
+		counters[i] = 0;
+		timer_counts[i] = 0;
+		timers[i] = 0;
+		latency_histogram_reset(&latencies[i]);
+		latency_histogram_reset(&corrected_latencies[i]);
+	}
+	latency_breakdown_export(str);
+	overhead_export(str);
+	str_printfa(str, "clients\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\t%u\n",
+		    stats->clients_count, stats->created_count,
+		    stats->target_count, stats->banner_waits,
+		    stats->stall_count, stats->arrivals_pending,
+		    stats->disconnects, stats->lmtp_active,
+		    stats->lmtp_failures);
+	array_foreach(stalled_lines, line)
+		str_printfa(str, "stalled\t%s\n", str_tabescape(*line));
+	str_append(str, "end\n");
+
+	o_stream_nsend(worker_output, str_data(str), str_len(str));
+	if (o_stream_flush(worker_output) < 0) {
+		i_fatal("write(parent) failed: %s",
+			o_stream_get_error(worker_output));
+	}
+}
+
+void workers_get_client_stats(struct client_stats *stats_r,
+			      ARRAY_TYPE(const_string) *stalled_lines)
+{
+	const struct worker *worker;
+	char *const *line;
+
+	i_zero(stats_r);
+	array_foreach(&workers, worker) {
+		stats_r->clients_count += worker->stats.clients_count;
+		stats_r->created_count += worker->stats.created_count;
+		stats_r->target_count += worker->stats.target_count;
+		stats_r->banner_waits += worker->stats.banner_waits;
+		stats_r->stall_count += worker->stats.stall_count;
+		stats_r->arrivals_pending += worker->stats.arrivals_pending;
+		stats_r->disconnects += worker->stats.disconnects;
+		stats_r->lmtp_active += worker->stats.lmtp_active;
+		stats_r->lmtp_failures += worker->stats.lmtp_failures;
+		array_foreach(&worker->stalled_lines, line)
+			array_append(stalled_lines, (const char *const *)line, 1);
+	}
+}
@@ -0,0 +1,51 @@
+#ifndef WORKERS_H
+#define WORKERS_H
+
+struct profile;
+
+#define STALL_PRINT_SHORT_SECS 3
+#define STALL_PRINT_LONG_SECS 15
+
+struct client_stats {
+	/* number of connected clients */
+	unsigned int clients_count;
+	/* number of clients created so far and how many are wanted */
+	unsigned int created_count, target_count;
+	/* clients still waiting for the banner */
+	unsigned int banner_waits;
+	/* clients stalled for more than STALL_PRINT_SHORT_SECS */
+	unsigned int stall_count;
+	/* open-loop arrivals not yet sent by any client */
+	unsigned int arrivals_pending;
+	/* disconnections since the start */
+	unsigned int disconnects;
+	/* LMTP deliveries in progress and failed since the start */
+	unsigned int lmtp_active, lmtp_failures;
+};
+
+/* Fork conf.workers_count worker processes. Each worker gets its own share
+   of the clients and users. Returns TRUE in the worker processes and FALSE
+   in the parent, which only collects and prints the workers' statistics. */
+bool workers_fork(struct profile *profile);
+/* Start sending (worker) or receiving (parent) statistics. Must be called
+   after the ioloop has been created. */
+void workers_init(void);
+void workers_deinit(void);
+
+bool workers_is_parent(void);
+bool workers_is_worker(void);
+/* Returns TRUE if the parent still has running workers. */
+bool workers_have_running(void);
+/* Returns the highest exit code of the finished workers. */
+int workers_get_exit_code(void);
+
+/* Worker: send the statistics gathered since the previous call to the
+   parent and reset them. stalled_lines contains the long stall reports. */
+void worker_send_stats(const struct client_stats *stats,
+		       const ARRAY_TYPE(const_string) *stalled_lines);
+/* Parent: get the sum of the workers' latest client statistics and their
+   latest long stall reports. */
+void workers_get_client_stats(struct client_stats *stats_r,
+			      ARRAY_TYPE(const_string) *stalled_lines);
+
+#endif
@@ -16,7 +16,8 @@ import tempfile
 # Size distribution can be configured here. By default, a mbox with 5 mails of
 # 10kB, 80kB, 150kB and 250kB each in a randomized order are created.
 # ImapTest iterates through the mbox sequentially, so all randomness must be
-# in the mbox file.
+# in the mbox file - unless ImapTest's msg_sizes setting is used, which picks
+# the messages randomly according to its own size distribution.
 size_distribution = {
   10:    5,
   80:    5,